@@ -23,11 +23,9 @@
 
 #include <cmath>
 #include <cstring>
-#include <unistd.h>
-
-#include <jack/midiport.h>
 
 #include "azr3.hpp"
+#include "fft.hpp"
 
 
 using namespace std;
@@ -58,9 +56,6 @@ AZR3::AZR3(double rate)
     cross1(0),
     lspeed(0),
     uspeed(0),
-    er_r(0),
-    er_r_before(0),
-    er_l(0),
     er_feedback(0),
     llfo_out(0),
     llfo_nout(0),
@@ -70,31 +65,82 @@ AZR3::AZR3(double rate)
     lfo_nout(0),
     lfo_d_out(0),
     lfo_d_nout(0),
-    wand_r(int(4410 * rate_scale), false),
-    wand_l(int(4410 * rate_scale), false),
-    delay1(int(4410 * rate_scale), true),
-    delay2(int(4410 * rate_scale), true),
-    delay3(int(4410 * rate_scale),true),
-    delay4(int(4410 * rate_scale),true),
+    wand(int(4410 * rate_scale)),
+    rdelays(int(4410 * rate_scale)),
     lfo1((float)rate),
     lfo2((float)rate),
     lfo3((float)rate),
     lfo4((float)rate),
+    horn_motor((float)rate),
+    drum_motor((float)rate),
+    rotor((float)rate),
+    m_effect_only(false),
     last_shape(-1),
     //mute(true),
-    last_r(0),
-    last_l(0),
     pedal(false),
     m_automated_change(false),
-    m_program_change(255) {
+    m_program_change(255),
+    m_worker_callback(0),
+    m_worker_data(0),
+    m_changes_lost(false),
+    m_active_set(&m_tablesets[0]),
+    m_fading_set(0),
+    m_fade_frames(int(0.005 * rate) + 1),
+    m_fade_left(0),
+    m_use_clock(0),
+    m_prepare_pending(false),
+    m_morph_state(morph_off),
+    m_morph_program(0),
+    m_morph_cc(-1),
+    m_morph_set(0),
+    m_morph_pos(0),
+    m_morph_target(0),
+    m_morph_step(0),
+    m_morph_reported(0),
+    m_morph_tables_changed(false),
+    m_morph_request_pending(false),
+    m_midi_map(new CompiledMidiMap(MidiMap())),
+    m_next_midi_map(0),
+    m_timing_version(0),
+    m_timing_reset(false),
+    m_learn_control(-1) {
   
-  for (int x = 0; x < kNumParams + 3; ++x)
+  for (int x = 0; x < kNumParams; ++x)
     m_ports[x] = 0;
   
+  v2f zero = { 0, 0 };
+  er = last_rl = zero;
+  
   pthread_mutex_init(&m_notemaster_lock, 0);
   
-  for(int x = 0; x < WAVETABLESIZE * 12 + 1; x++)
-    wavetable[x] = 0;
+  // the first set is silent until the worker has computed some tables
+  for (int s = 0; s < NUM_TABLESETS; ++s) {
+    TableSet& set = m_tablesets[s];
+    memset(set.data, 0, sizeof(set.data));
+    for (int x = 0; x < NUM_TABLE_CONTROLS; ++x)
+      set.key[x] = -99;
+    for (int x = 0; x < 3; ++x) {
+      for (int y = 0; y < 9; ++y)
+	set.drawbars[x][y] = 0;
+      set.incremental_updates[x] = 0;
+    }
+    set.shape = -1;
+    set.live = true;
+    set.last_used = 0;
+    set.state = ts_free;
+  }
+  m_active_set->state = ts_active;
+  
+  for (int x = 0; x < 128; ++x) {
+    m_programs[x].version = 0;
+    m_programs[x].stored = false;
+  }
+  
+  for (int x = 0; x < 16; ++x) {
+    m_nrpn[x].msb = -1;
+    m_nrpn[x].lsb = -1;
+    m_nrpn[x].value = 0;
+  }
 
   for(int x = 0; x < kNumParams; x++) {
     last_value[x] = -99;
@@ -111,6 +157,16 @@ AZR3::AZR3(double rate)
     slow_controls[n_3_db1 + x] = true;
   slow_controls[n_shape] = true;
   
+  // the switches and the knobs that have steps
+  static const uint32_t discrete[] = { 
+    n_mono, n_shape, n_perc, n_1_perc, n_1_vibrato, n_2_perc, n_2_vibrato,
+    n_3_perc, n_mrvalve, n_set, n_speakers, n_speed, n_complex, 
+    n_pedalspeed, n_splitpoint, n_1_sustain, n_2_sustain, n_3_sustain };
+  for (int x = 0; x < kNumParams; ++x)
+    discrete_controls[x] = false;
+  for (unsigned x = 0; x < sizeof(discrete) / sizeof(discrete[0]); ++x)
+    discrete_controls[discrete[x]] = true;
+  
   warmth.setparam(2700, 1.2f, samplerate);
 
   n1.set_samplerate(samplerate);
@@ -121,15 +177,13 @@ AZR3::AZR3(double rate)
   split.setparam(400, 1.3f, samplerate);
   horn_filt.setparam(2500, .5f, samplerate);
   damp.setparam(200, .9f, samplerate);
-  wand_r.set_samplerate(samplerate);
-  wand_r.set_delay(35);
-  wand_l.set_samplerate(samplerate);
-  wand_l.set_delay(20);
-
-  delay1.set_samplerate(samplerate);
-  delay2.set_samplerate(samplerate);
-  delay3.set_samplerate(samplerate);
-  delay4.set_samplerate(samplerate);
+  wand.set_samplerate(samplerate);
+  wand.set_delay(0, 35);
+  wand.set_delay(1, 20);
+
+  rdelays.set_samplerate(samplerate);
+  for (int x = 0; x < 4; ++x)
+    rdelays.set_delay(x, 0);
   lfo1.set_samplerate(samplerate);
   lfo2.set_samplerate(samplerate);
   lfo3.set_samplerate(samplerate);
@@ -143,6 +197,11 @@ AZR3::AZR3(double rate)
 
 AZR3::~AZR3() {
   pthread_mutex_destroy(&m_notemaster_lock);
+  CompiledMidiMap* map;
+  while (m_old_midi_maps.pop(map))
+    delete map;
+  delete m_next_midi_map;
+  delete m_midi_map;
 }
 
 
@@ -150,38 +209,42 @@ void AZR3::activate() {
 
   //mute = false;
 
-  for(int x = 0; x < 4; x++) {
-    allpass_r[x].reset();
-    allpass_l[x].reset();
-  }
+  for(int x = 0; x < 4; x++)
+    allpass[x].reset();
   
-  delay1.flood(0);
-  delay2.flood(0);
-  delay3.flood(0);
-  delay4.flood(0);
+  rdelays.flood(0);
   vdelay1.flood(0);
   vdelay2.flood(0);
-  wand_r.flood(0);
-  wand_l.flood(0);
+  wand.flood(0);
+  rotor.reset();
   
   sem_init(&m_qsem, 0, 1);
-  pthread_create(&m_worker, 0, &AZR3::worker_function, this);
+  if (!m_worker_callback) {
+    sem_init(&m_work_sem, 0, 0);
+    m_worker_quit = false;
+    pthread_create(&m_worker, 0, &AZR3::worker_function, this);
+  }
 }
 
 
 void AZR3::deactivate() {
-  pthread_cancel(m_worker);
-  pthread_join(m_worker, 0);
+  if (!m_worker_callback) {
+    m_worker_quit = true;
+    sem_post(&m_work_sem);
+    pthread_join(m_worker, 0);
+    sem_destroy(&m_work_sem);
+  }
   sem_destroy(&m_qsem);
 }
 
 
 void AZR3::connect_port(uint32_t port, void* buffer) {
-  m_ports[port] = buffer;
+  if (port < kNumParams)
+    m_ports[port] = buffer;
 }
 
 
-void AZR3::run(uint32_t sampleFrames) {
+void AZR3::process(const ProcessContext& ctx) {
   
   /*
     OK, here we go. This is the order of actions in here:
@@ -194,28 +257,118 @@ void AZR3::run(uint32_t sampleFrames) {
     control values.
     - calculate switch smoothing to prevent clicks
     - vibrato
+    - mix in the audio input
     - additional low pass "warmth"
     - distortion
     - speakers
   */
   
-  float* out1 = p(64);
-  float* out2 = p(65);
+  uint32_t sampleFrames = ctx.nframes;
+  float* out1 = ctx.output[0];
+  float* out2 = ctx.output[1];
+  const float* in1 = ctx.input[0];
+  const float* in2 = ctx.input[1];
+  float* const* dry = ctx.dry;
+  float* prespeaker = ctx.prespeaker;
+  float* speaker1 = ctx.speaker[0];
+  float* speaker2 = ctx.speaker[1];
+  
+  // the MIDI timing statistics are updated during the whole cycle
+  ++m_timing_version;
+  __sync_synchronize();
+  if (m_timing_reset) {
+    m_timing_reset = false;
+    m_timing.reset();
+  }
+  ++m_timing.cycles;
+  m_timing.events += ctx.event_count;
+  if (sampleFrames < m_timing.min_nframes)
+    m_timing.min_nframes = sampleFrames;
+  if (sampleFrames > m_timing.max_nframes)
+    m_timing.max_nframes = sampleFrames;
   
   // if the notemaster mutex is locked, don't try to render anything
   if (pthread_mutex_trylock(&m_notemaster_lock)) {
-    memset(out1, 0, sizeof(float) * sampleFrames);
-    memset(out2, 0, sizeof(float) * sampleFrames);
+    float* outputs[] = { out1, out2, dry[0], dry[1], dry[2], prespeaker,
+			 speaker1, speaker2 };
+    for (unsigned i = 0; i < sizeof(outputs) / sizeof(outputs[0]); ++i) {
+      if (outputs[i])
+	memset(outputs[i], 0, sizeof(float) * sampleFrames);
+    }
+    m_timing.dropped += ctx.event_count;
+    __sync_synchronize();
+    ++m_timing_version;
     return;
   }
   
-  // send slow port changes to the worker thread
+  // switch to a new MIDI map, set_midi_map() deletes the old one
+  CompiledMidiMap* map = 
+    __sync_lock_test_and_set(&m_next_midi_map, (CompiledMidiMap*)0);
+  if (map) {
+    m_old_midi_maps.push(m_midi_map);
+    m_midi_map = map;
+  }
+  
+  // start a new morph
+  MorphRequest request;
+  while (m_morph_requests.pop(request))
+    start_morph(request.from, request.to, request.seconds, request.cc);
+  
+  // switch to new wavetables if the worker has computed them. A morph
+  // crossfades between the tables of its two programs instead
+  if (m_morph_state != morph_running)
+    select_tables();
+  else
+    update_morph_tables();
+  if (m_morph_state == morph_waiting)
+    begin_morph();
+  
+  // let the frontend know that the morph has moved the controls
+  if (m_morph_state == morph_running && m_morph_pos != m_morph_reported) {
+    m_morph_reported = m_morph_pos;
+    if (!m_changed_controls.push(kNumParams))
+      m_changes_lost = true;
+    m_automated_change = true;
+  }
+  
+  // send slow port changes to the worker thread. While morphing the
+  // drawbars that the morph moves don't get tables of their own, the
+  // voices crossfade between the tables of the two programs. The other
+  // drawbars are changed in both programs, and the worker computes new
+  // tables for both.
+  if (m_morph_state == morph_running) {
+    for (int i = 0; i < kNumParams; ++i) {
+      if (slow_controls[i] && i != n_mono &&
+	  m_morph_from[i] == m_morph_to[i] && *p(i) != m_morph_to[i]) {
+	m_morph_from[i] = m_morph_to[i] = *p(i);
+	m_morph_tables_changed = true;
+      }
+    }
+  }
   if (!sem_trywait(&m_qsem)) {
+    bool changed = false;
     for (int i = 0; i < kNumParams; ++i) {
-      if (slow_controls[i])
+      if (m_morph_state == morph_running && i != n_mono)
+	continue;
+      if (slow_controls[i] && m_values[i].new_value != *p(i)) {
 	m_values[i].new_value = *p(i);
+	changed = true;
+      }
+    }
+    if (m_morph_tables_changed) {
+      memcpy(m_morph_request[0], m_morph_from, sizeof(m_morph_from));
+      memcpy(m_morph_request[1], m_morph_to, sizeof(m_morph_to));
+      m_morph_request_pending = true;
+      m_morph_tables_changed = false;
+      changed = true;
     }
     sem_post(&m_qsem);
+    if (changed)
+      wake_worker();
+  }
+  if (m_prepare_pending) {
+    m_prepare_pending = false;
+    wake_worker();
   }
   
   // vibrato handling
@@ -317,12 +470,13 @@ void AZR3::run(uint32_t sampleFrames) {
   float uslow = 10 * *p(n_u_slow);
   float ufast = 10 * *p(n_u_fast);
   
-  // belt (?)
+  // belt (?) - the rotor inertia. A higher value means a tighter belt and
+  // faster speed changes. The time constants are chosen so the default
+  // speeds change in about the same time as with the old linear steps.
   value = *p(n_belt);
-  float ubelt_up = (value * 3 + 1) * 0.012f;
-  float ubelt_down = (value * 3 + 1) * 0.008f;
-  float lbelt_up = (value * 3 + 1) * 0.0045f;
-  float lbelt_down = (value * 3 + 1) * 0.0035f;
+  float belt = 1 / (value * 3 + 1);
+  horn_motor.set_times(0.46f * belt, 0.69f * belt);
+  drum_motor.set_times(0.92f * belt, 1.19f * belt);
   
   if (oldspread != *p(n_spread)) {
     lfos_ok = false;
@@ -332,21 +486,26 @@ void AZR3::run(uint32_t sampleFrames) {
   // keyboard split
   splitpoint = (long)(*p(n_splitpoint) * 128);
   
-  jack_nframes_t event_index = 0;
-  void* midi = p<void>(63);
-  jack_nframes_t event_count = jack_midi_get_event_count(midi, sampleFrames);
+  uint32_t event_index = 0;
+  uint32_t event_count = ctx.event_count;
   int     x;
   float last_out1, last_out2;
-  unsigned char* evt;
-  jack_midi_event_t event;
+  const unsigned char* evt;
+  MidiEvent event = { 0, 0, 0 };
   uint32_t pframe = 0;
+  float voice_out[3][ENVBLOCKSIZE];
+  uint32_t vblock_pos = 0, vblock_len = 0;
 
   while (event_index <= event_count) {
     
     if (event_index == event_count)
       event.time = sampleFrames;
-    else
-      jack_midi_event_get(&event, midi, event_index, sampleFrames);
+    else {
+      event = ctx.events[event_index];
+      // don't render past the end of the buffers for a broken event
+      if (event.time > sampleFrames)
+	event.time = sampleFrames;
+    }
     ++event_index;
       
     for ( ; pframe < event.time; ++pframe) {
@@ -360,10 +519,29 @@ void AZR3::run(uint32_t sampleFrames) {
       if (*p(n_pedalspeed) >= 0.5)
 	fastmode = pedal;
       
-      float* p_mono = n1.clock();
-      float mono1 = p_mono[0];
-      float mono2 = p_mono[1];
-      float mono = p_mono[2];
+      // the voices are rendered in blocks that never cross a MIDI event
+      if (vblock_pos == vblock_len) {
+	vblock_len = event.time - pframe;
+	if (vblock_len > ENVBLOCKSIZE)
+	  vblock_len = ENVBLOCKSIZE;
+	if (m_morph_state == morph_running)
+	  run_morph(vblock_len);
+	if (m_effect_only)
+	  memset(voice_out, 0, sizeof(voice_out));
+	else {
+	  n1.render(voice_out, vblock_len);
+	  for (int i = 0; i < n1.get_num_onsets(); ++i)
+	    ++m_timing.note_latency[MidiTiming::bucket(n1.get_onset(i))];
+	  // the voices have faded out the old tables for this long
+	  if (m_fading_set && (m_fade_left -= vblock_len) <= 0)
+	    finish_fade();
+	}
+	vblock_pos = 0;
+      }
+      float mono1 = voice_out[0][vblock_pos];
+      float mono2 = voice_out[1][vblock_pos];
+      float mono = voice_out[2][vblock_pos];
+      ++vblock_pos;
       
       // smoothing of vibrato switch 1
       if (vibchanged1 && samplecount % 10 == 0) {
@@ -434,9 +612,23 @@ void AZR3::run(uint32_t sampleFrames) {
 	mono2 = (1 - vmix2) * mono2 + vmix2 * vdelay2.clock(mono2);
       }
       
+      // the dry outputs for the manuals
+      if (dry[0])
+	dry[0][pframe] = mono1 * 1.4f * *p(n_master);
+      if (dry[1])
+	dry[1][pframe] = mono2 * 1.4f * *p(n_master);
+      if (dry[2])
+	dry[2][pframe] = mono * 1.4f * *p(n_master);
+      
       mono += mono1 + mono2;
       mono *= 1.4f;
       
+      // the audio input goes through the same effects as the organ
+      if (in1)
+	mono += 0.5f * in1[pframe];
+      if (in2)
+	mono += 0.5f * in2[pframe];
+      
       // Mr. Valve
       /*
 	Completely rebuilt.
@@ -468,6 +660,8 @@ void AZR3::run(uint32_t sampleFrames) {
 	}
 	mono = warmth.clock(mono);
       }
+      if (prespeaker)
+	prespeaker[pframe] = mono * *p(n_master);
       
       // Speakers
       /*
@@ -495,30 +689,29 @@ void AZR3::run(uint32_t sampleFrames) {
 	This should make it sound more realistic.
       */
       
-      if (*p(n_speakers) > 0.5) {
+      if (*p(n_speakers) > 0.5 && samplecount % ROTORBLOCK == 0) {
+	uspeed = horn_motor.step(fastmode ? ufast : uslow);
+	lspeed = drum_motor.step(fastmode ? lfast : lslow);
+	
+	// the LFOs keep their phase when the rate changes, and setting the
+	// rate of a triangle LFO is just a division
+	lfo1.set_rate(uspeed * 5, 1);
+	lfo2.set_rate(uspeed * 5, 1);
+	lfo3.set_rate(lspeed * 5, 1);
+	lfo4.set_rate(lspeed * 5, 1);
+      }
+      
+      if (*p(n_speakers) > 0.5 && rotor.get_quality() != ROTOR_CLASSIC) {
+	// the modelled rotary speaker, see rotor.hpp
+	float left, right;
+	rotor.set_spread(*p(n_spread));
+	rotor.set_speeds(uspeed, lspeed);
+	rotor.clock(mono, left, right);
+	last_out1 = left * *p(n_master);
+	last_out2 = right * *p(n_master);
+      }
+      else if (*p(n_speakers) > 0.5) {
 	if (samplecount % 100 == 0) {
-	  if (fastmode) {
-	    if (lspeed < lfast)
-	      lspeed += lbelt_up;
-	    if (lspeed > lfast)
-	      lspeed = lfast;
-	    
-	    if (uspeed < ufast)
-	      uspeed += ubelt_up;
-	    if (uspeed > ufast)
-	      uspeed = ufast;
-	  }
-	  else {
-	    if (lspeed > lslow)
-	      lspeed -= lbelt_down;
-	    if (lspeed < lslow)
-	      lspeed = lslow;
-	    if (uspeed > uslow)
-	      uspeed -= ubelt_down;
-	    if (uspeed < uslow)
-	      uspeed = uslow;
-	  }
-	  
 	  //recalculate mic positions when "spread" has changed
 	  if(!lfos_ok) {
 	    float s = (*p(n_spread) + 0.5f) * 0.8f;
@@ -549,16 +742,6 @@ void AZR3::run(uint32_t sampleFrames) {
 	    er_feedback = 0.03f * cross1;
 	    lfos_ok = true;
 	  }
-	  
-	  if (lspeed != lfo3.get_rate()) {
-	    lfo3.set_rate(lspeed * 5, 1);
-	    lfo4.set_rate(lspeed * 5, 1);
-	  }
-	  
-	  if (uspeed != lfo1.get_rate()) {
-	    lfo1.set_rate(uspeed * 5, 1);
-	    lfo2.set_rate(uspeed * 5, 1);
-	  } 
 	}
 	
 	// split signal into upper and lower cabinet speakers
@@ -578,8 +761,8 @@ void AZR3::run(uint32_t sampleFrames) {
 	  lfo_d_out = lfo1.clock();
 	  lfo_d_nout = 1 - lfo_d_out;
 	  
-	  delay1.set_delay(10 + lfo_d_out * 0.8f);
-	  delay2.set_delay(17 + lfo_d_nout * 0.8f);
+	  rdelays.set_delay(0, 10 + lfo_d_out * 0.8f);
+	  rdelays.set_delay(1, 17 + lfo_d_nout * 0.8f);
 	  
 	  lfo_d_nout = lfo2.clock();
 	  
@@ -591,10 +774,8 @@ void AZR3::run(uint32_t sampleFrames) {
 	  //  DSPing is so much nicer than soldering...)
 	  float lfo_phaser1 = (1 - cosf(lfo_d_out * 1.8f) + 1) * 0.054f;
 	  float lfo_phaser2 = (1 - cosf(lfo_d_nout * 1.8f) + 1) * .054f;
-	  for(x = 0; x < 4; x++) {
-	    allpass_r[x].set_delay(lfo_phaser1);
-	    allpass_l[x].set_delay(lfo_phaser2);
-	  }
+	  for(x = 0; x < 4; x++)
+	    allpass[x].set_delay(lfo_phaser1, lfo_phaser2);
 	  
 	  if(lslow > 0) {
 	    llfo_d_out = lfo3.clock();
@@ -603,8 +784,8 @@ void AZR3::run(uint32_t sampleFrames) {
 	  
 	  // additional delay lines in complex mode
 	  if(*p(n_complex) > 0.5f) {
-	    delay4.set_delay(llfo_d_out + 15);
-	    delay3.set_delay(llfo_d_nout + 25);
+	    rdelays.set_delay(3, llfo_d_out + 15);
+	    rdelays.set_delay(2, llfo_d_nout + 25);
 	  }
 	  
 	  llfo_d_nout = lfo4.clock();
@@ -612,61 +793,60 @@ void AZR3::run(uint32_t sampleFrames) {
 	  llfo_nout = llfo_d_nout * spread + spread2;
 	}
 	
-	float lright, lleft;
+	/*
+	  From here on the right and left channels are the two lanes of
+	  one vector, rl = { right, left }. The channels only meet in the
+	  cross-fed early reflections, and those use the other channel's
+	  value from the previous sample, so that is just a lane swap.
+	*/
+	v2f lrl;
 	if(lslow > 0) {
-	  lright = (1 + 0.6f * llfo_out) * lower;
-	  lleft = (1 + 0.6f * llfo_nout) * lower;
+	  v2f llfo_rl = { llfo_out, llfo_nout };
+	  lrl = (1 + 0.6f * llfo_rl) * lower;
 	}
 	else {
-	  lright = lleft = lower;
+	  v2f lower_rl = { lower, lower };
+	  lrl = lower_rl;
 	}
 	
 	// emulate vertical horn characteristics
 	// (sound is dampened when listened from aside)
-	float right = (3 + lfo_nout * 2.5f) * upper + 1.5f * upper_damp;
-	float left = (3 + lfo_out * 2.5f) * upper + 1.5f * upper_damp;
+	v2f lfo_rl = { lfo_nout, lfo_out };
+	v2f rl = (3 + lfo_rl * 2.5f) * upper + 1.5f * upper_damp;
 	
 	//phaser...
-	last_r = allpass_r[0].clock(
-	         allpass_r[1].clock(
-	         allpass_r[2].clock(
-	         allpass_r[3].clock(upper + last_r * 0.33f))));
-	last_l = allpass_l[0].clock(
-	         allpass_l[1].clock(
-	         allpass_l[2].clock(
-	         allpass_l[3].clock(upper + last_l * 0.33f))));
-
-	right += last_r;
-	left += last_l;
+	last_rl = allpass[0].clock(
+	          allpass[1].clock(
+	          allpass[2].clock(
+	          allpass[3].clock(upper + last_rl * 0.33f))));
+
+	rl += last_rl;
 	
 	// rotating speakers can only develop in a live room -
 	// wouldn't work without some early reflections.
-	er_r = wand_r.clock(right + lright - (left *0.3f) - er_l * er_feedback);
-	er_r = DENORMALIZE(er_r);
-	er_l = wand_l.clock(left + lleft - (right * .3f) - 
-			    er_r_before * er_feedback);
-	er_l = DENORMALIZE(er_l);
-	er_r_before = er_r;
+	v2f lr = { rl[1], rl[0] };
+	v2f er_lr = { er[1], er[0] };
+	er = wand.clock(rl + lrl - lr * 0.3f - er_lr * er_feedback);
+	v2f zero = { 0, 0 };
+	er = (er < .00000001f && er > -.00000001f) ? zero : er;
 	
-	
-	// We use two additional delay lines in "complex" mode
+	// the four modulated delay lines run as one, the last two are
+	// only used in "complex" mode
+	v4f din = { rl[0], rl[1], er[0], er[1] };
+	v4f dout = rdelays.clock(din);
+	v2f d12 = { dout[0], dout[1] };
 	if (*p(n_complex) > 0.5f) {
-	  right = right * 0.3f + 1.5f * er_r + 
-	    delay1.clock(right) + delay3.clock(er_r);
-	  left = left * 0.3f + 1.5f * er_l + 
-	    delay2.clock(left) + delay4.clock(er_l);
-	}
-	else {
-	  right = right * 0.3f + 1.5f * er_r + delay1.clock(right) + lright;
-	  left = left * 0.3f + 1.5f * er_l + delay2.clock(left) + lleft;
+	  v2f d34 = { dout[2], dout[3] };
+	  rl = rl * 0.3f + 1.5f * er + d12 + d34;
 	}
+	else
+	  rl = rl * 0.3f + 1.5f * er + d12 + lrl;
 	
-	right *= 0.033f;
-	left *= 0.033f;
+	rl *= 0.033f;
 	
 	// spread crossover (emulates mic positions)
-	last_out1 = (left + cross1 * right) * *p(n_master);
-	last_out2 = (right + cross1 * left) * *p(n_master);
+	last_out1 = (rl[1] + cross1 * rl[0]) * *p(n_master);
+	last_out2 = (rl[0] + cross1 * rl[1]) * *p(n_master);
       }
       else {
 	last_out1 = last_out2 = mono * *p(n_master);
@@ -676,20 +856,36 @@ void AZR3::run(uint32_t sampleFrames) {
       //  last_out2 = 0;
       //}
       
-      (*out1++) = last_out1;
-      (*out2++) = last_out2;
+      out1[pframe] = last_out1;
+      out2[pframe] = last_out2;
+      if (speaker1)
+	speaker1[pframe] = (*p(n_speakers) > 0.5 ? last_out1 : 0);
+      if (speaker2)
+	speaker2[pframe] = (*p(n_speakers) > 0.5 ? last_out2 : 0);
     }
     
     // Handle MIDI event
     if (event.time < sampleFrames) {
-      evt = event.buffer;
+      evt = event.data;
       unsigned char status = evt[0] & 0xF0;
-      if (event.size >= 3 && status >= 0x80 && status <= 0xE0) {
+      uint32_t size = (status == 0xC0 || status == 0xD0 ? 2 : 3);
+      
+      // the frames are only rendered up to the event if it is sorted
+      uint32_t latency = pframe - event.time;
+      ++m_timing.offsets[MidiTiming::bucket(event.time)];
+      if (latency > 0) {
+	++m_timing.late;
+	if (latency > m_timing.max_latency)
+	  m_timing.max_latency = latency;
+      }
+
+      if (event.size >= size && status >= 0x80 && status <= 0xE0) {
 	unsigned char channel = evt[0] & 0x0F;
 	
 	if (channel < 3) {
 	  
 	  volatile float* tbl;
+	  int fold;
 	  
 	  // do the keyboard split
 	  if ((status == 0x80 || status == 0x90) &&
@@ -707,28 +903,23 @@ void AZR3::run(uint32_t sampleFrames) {
 	      // here we choose the correct wavetable according to the played note
 #define foldstart 80
 	      if (note > foldstart + 12 + 12)
-		tbl = &wavetable[channel * WAVETABLESIZE * TABLES_PER_CHANNEL +
-				 WAVETABLESIZE * 7];
+		fold = 7;
 	      else if (note > foldstart + 12 + 8)
-		tbl = &wavetable[channel * WAVETABLESIZE * TABLES_PER_CHANNEL +
-				 WAVETABLESIZE * 6];
+		fold = 6;
 	      else if (note > foldstart + 12 + 5)
-		tbl = &wavetable[channel * WAVETABLESIZE * TABLES_PER_CHANNEL +
-				 WAVETABLESIZE * 5];
+		fold = 5;
 	      else if (note > foldstart + 12)
-		tbl = &wavetable[channel * WAVETABLESIZE * TABLES_PER_CHANNEL +
-				 WAVETABLESIZE * 4];
+		fold = 4;
 	      else if (note > foldstart + 8)
-		tbl = &wavetable[channel * WAVETABLESIZE * TABLES_PER_CHANNEL + 
-				 WAVETABLESIZE * 3];
+		fold = 3;
 	      else if (note > foldstart + 5)
-		tbl = &wavetable[channel * WAVETABLESIZE * TABLES_PER_CHANNEL +
-				 WAVETABLESIZE * 2];
+		fold = 2;
 	      else if (note > foldstart)
-		tbl = &wavetable[channel * WAVETABLESIZE * TABLES_PER_CHANNEL +
-				 WAVETABLESIZE];
+		fold = 1;
 	      else
-		tbl = &wavetable[channel * WAVETABLESIZE * TABLES_PER_CHANNEL];
+		fold = 0;
+	      tbl = &m_active_set->data[(channel * TABLES_PER_CHANNEL + fold) * 
+					MIPCHAINSIZE];
 	      
 	      if (channel == 0) {
 		if (*p(n_1_perc) > 0)
@@ -750,7 +941,7 @@ void AZR3::run(uint32_t sampleFrames) {
 	      }
 	      
 	      n1.note_on(note, evt[2], tbl, WAVETABLESIZE, 
-			 channel, percenable, click[channel], sustain);
+			 channel, percenable, click[channel], sustain, latency);
 	      break;
 	    }
 	    
@@ -771,10 +962,8 @@ void AZR3::run(uint32_t sampleFrames) {
 		n1.set_pedal(evt[2], channel);
 	    }
 	    
-	    else if (cc_map[evt[1]] != 63) {
-	      *p(cc_map[evt[1]]) = evt[2] / 127.0;
-	      m_automated_change = true;
-	    }
+	    else
+	      map_controller(channel, evt[1], evt[2]);
 	    
 	    break;
 	    
@@ -797,17 +986,25 @@ void AZR3::run(uint32_t sampleFrames) {
 	  }
 	    
 	  case 0xC0:
-	    m_program_change = evt[1];
+	    program_change(evt[1]);
 	    break;
 	    
 	  }
 	}
+	
+	// the other channels can only be used for the controllers in the map
+	else if (status == 0xB0)
+	  map_controller(channel, evt[1], evt[2]);
       }
     }
+    else if (event_index <= event_count)
+      ++m_timing.dropped;
 
   }
   
   pthread_mutex_unlock(&m_notemaster_lock);
+  __sync_synchronize();
+  ++m_timing_version;
 }
 
 
@@ -884,189 +1081,643 @@ bool AZR3::make_waveforms(int shape) {
     }
   }
         
-  for (i = 0; i < WAVETABLESIZE; i++) {
-    //              int     f=TONEWHEELSIZE/WAVETABLESIZE;
-    int f = 1;
-    int     icount;
-    int i2[9];
-                
-    i2[0] = (int)(i * 1 * f);
-    i2[1] = (int)(i * 2 * f);
-    i2[2] = (int)(i * 3 * f);
-    i2[3] = (int)(i * 4 * f);
-    i2[4] = (int)(i * 6 * f);
-    i2[5] = (int)(i * 8 * f);
-    i2[6] = (int)(i * 10 * f);
-    i2[7] = (int)(i * 12 * f);
-    i2[8] = (int)(i * 16 * f);
-                
-    for (icount = 0; icount < 9; icount++) {
-      while(i2[icount] >= WAVETABLESIZE)
-	i2[icount] -= WAVETABLESIZE;
+  // the pitch multipliers for the different drawbars
+  static const int multipliers[9] = { 1, 2, 3, 4, 6, 8, 10, 12, 16 };
+  
+  for (int d = 0; d < 9; d++) {
+    
+    // folded versions are one octave lower and less loud for every step
+    for (int f = 0; f < 4; f++) {
+      float level = 1.0f / (1 << f);
+      for (i = 0; i < WAVETABLESIZE; i++)
+	harmonics[d][f][i] = 
+	  tonewheel[((i * multipliers[d]) >> f) % WAVETABLESIZE] * level;
+      make_mip_levels(harmonics[d][f]);
     }
-                
-    sin_16[i] = tonewheel[i2[0]];
-    sin_8[i] = tonewheel[i2[1]];
-    sin_513[i] = tonewheel[i2[2]];
-    sin_4[i] = tonewheel[i2[3]];
-    sin_223[i] = tonewheel[i2[4]];
-    sin_2[i] = tonewheel[i2[5]];
-    sin_135[i] = tonewheel[i2[6]];
-    sin_113[i] = tonewheel[i2[7]];
-    sin_1[i] = tonewheel[i2[8]];
   }
         
   return true;
 }
 
 
+/*
+  This is very important for a warm sound:
+  The "tone wheels" are a limited resource and they
+  supply limited pitch heights. If a drawbar register
+  is forced to play a tune above the highest possible
+  note it will simply be transposed one octave down.
+  In addition it will appear less loud.
+  
+  This table says which version of the drawbar waveforms in harmonics
+  is used in each of the tables for a channel, from the lowest notes to
+  the highest. 0 is the original, 1-3 are folded down 1-3 octaves and -1
+  means that the drawbar isn't used at all. The first set is for the upper
+  and lower manuals, the second one is for the pedals which only have 
+  five drawbars.
+  
+  The grown up source code viewer will find that sin_135 is only
+  folded once (/2). Well, I had terrible aliasing problems when
+  folding it twice (/4), and the easiest solution was to set it to
+  zero instead. You can't claim you actually heard it, can you?
+*/
+static const int fold_levels[2][TABLES_PER_CHANNEL][9] = {
+  { { 0, 0, 0, 0, 0, 0,  0, 0, 0 },
+    { 0, 0, 0, 0, 0, 0,  0, 0, 1 },
+    { 0, 0, 0, 0, 0, 0,  0, 1, 1 },
+    { 0, 0, 0, 0, 0, 0,  1, 1, 1 },
+    { 0, 0, 0, 0, 0, 1,  1, 1, 2 },
+    { 0, 0, 0, 0, 1, 1,  1, 2, 2 },
+    { 0, 0, 0, 0, 1, 1, -1, 2, 2 },
+    { 0, 0, 0, 1, 1, 2, -1, 2, 3 } },
+  { { 0, 0, 0, 0, 0, -1, -1, -1, -1 },
+    { 0, 0, 0, 0, 0, -1, -1, -1, -1 },
+    { 0, 0, 0, 0, 0, -1, -1, -1, -1 },
+    { 0, 0, 0, 0, 0, -1, -1, -1, -1 },
+    { 0, 0, 0, 0, 0, -1, -1, -1, -1 },
+    { 0, 0, 0, 0, 1, -1, -1, -1, -1 },
+    { 0, 0, 0, 0, 1, -1, -1, -1, -1 },
+    { 0, 0, 0, 1, 1, -1, -1, -1, -1 } }
+};
+
+
+// weight to each drawbar
+static const float drawbar_weights[9] = 
+  { 1.5f, 1.0f, 0.8f, 0.8f, 0.8f, 0.8f, 0.8f, 0.6f, 0.6f };
+
+
+/* Add factor * src to dst for a full wavetable with all its mip levels. 
+   This is kept simple so the compiler can vectorise it. */
+static inline void add_scaled(float* __restrict__ dst, 
+			      const float* __restrict__ src, float factor) {
+  for (int i = 0; i < MIPCHAINSIZE; i++)
+    dst[i] += factor * src[i];
+}
+
+
 // make one of the three waveform sets with four complete waves
 // per set. "number" is 1..3 and references the waveform set
-void AZR3::calc_waveforms(int number) {
+void AZR3::calc_waveforms(TableSet& set, int number, const float* controls) {
   
-  int i, c;
-  volatile float* t;
-  float   this_p[kNumParams];
+  int k, d, c, nd;
+  int channel = number - 1;
+  float* t;
 
-  for (c = 0; c < kNumParams; c++)
-    this_p[c] = m_values[c].old_value;
   if (number == 2) {
     c = n_2_db1;
-    t = &wavetable[WAVETABLESIZE * TABLES_PER_CHANNEL];
+    nd = 9;
   }
   else if (number == 3) {
-    t = &wavetable[WAVETABLESIZE * TABLES_PER_CHANNEL * 2];
     c = n_3_db1;
+    nd = 5;
   }
   else {
-    t = &wavetable[0];
     c = n_1_db1;
+    nd = 9;
+    channel = 0;
+  }
+  t = &set.data[channel * MIPCHAINSIZE * TABLES_PER_CHANNEL];
+  const int (*folds)[9] = fold_levels[channel == 2 ? 1 : 0];
+  float* drawbars = set.drawbars[channel];
+  
+  for (d = 0; d < nd; d++)
+    drawbars[d] = controls[c + d] * drawbar_weights[d];
+  set.incremental_updates[channel] = 0;
+  
+  for (k = 0; k < TABLES_PER_CHANNEL; k++) {
+    float* tk = t + k * MIPCHAINSIZE;
+    memset(tk, 0, sizeof(float) * MIPCHAINSIZE);
+    for (d = 0; d < nd; d++) {
+      if (folds[k][d] >= 0 && drawbars[d] != 0)
+	add_scaled(tk, harmonics[d][folds[k][d]], drawbars[d]);
+    }
   }
+}
 
-  // weight to each drawbar
-  this_p[c] *= 1.5f;
-  this_p[c+1] *= 1.0f;
-  this_p[c+2] *= 0.8f;
-  this_p[c+3] *= 0.8f;
-  this_p[c+4] *= 0.8f;
-  this_p[c+5] *= 0.8f;
-  this_p[c+6] *= 0.8f;
-  this_p[c+7] *= 0.6f;
-  this_p[c+8] *= 0.6f;
 
-  for (i = 0; i < WAVETABLESIZE; i++) {
-    t[i] = t[i + WAVETABLESIZE] = t[i + WAVETABLESIZE*2] = 
-      t[i+WAVETABLESIZE * 3] = t[i+WAVETABLESIZE * 4] =
-      t[i+WAVETABLESIZE * 5] = t[i+WAVETABLESIZE * 6] =
-      t[i+WAVETABLESIZE * 7] =
-      sin_16[i] * this_p[c] + 
-      sin_8[i] * this_p[c+1] +
-      sin_513[i] * this_p[c+2];
-
-    /*
-      This is very important for a warm sound:
-      The "tone wheels" are a limited resource and they
-      supply limited pitch heights. If a drawbar register
-      is forced to play a tune above the highest possible
-      note it will simply be transposed one octave down.
-      In addition it will appear less loud; that's what
-      d2, d4 and d8 are for.
-    */
-#define d2 0.5f
-#define d4 0.25f
-#define d8 0.125f
-    if(number == 3) {
-      t[i] 
-        += sin_4[i] * this_p[c+3] + 
-        sin_223[i] * this_p[c+4];
-      t[i + WAVETABLESIZE * 1] +=
-        sin_4[i] * this_p[c + 3] + 
-        sin_223[i] * this_p[c + 4];
-      t[i + WAVETABLESIZE * 2] += 
-        sin_4[i] * this_p[c + 3] + 
-        sin_223[i] * this_p[c + 4];
-      t[i + WAVETABLESIZE * 3] += 
-        sin_4[i] * this_p[c + 3] + 
-        sin_223[i] * this_p[c + 4];
-      t[i + WAVETABLESIZE * 4] += 
-        sin_4[i] * this_p[c + 3] + 
-        sin_223[i] * this_p[c + 4];
-      t[i + WAVETABLESIZE * 5] += 
-        sin_4[i] * this_p[c + 3] +
-        sin_223[int(i / 2)] * d2 * this_p[c + 4];
-      t[i + WAVETABLESIZE * 6] += 
-        sin_4[i] * this_p[c+3] + 
-        sin_223[int(i / 2)] * d2 * this_p[c + 4];
-      t[i + WAVETABLESIZE * 7] += 
-        sin_4[int(i / 2)] * d2 * this_p[c + 3] + 
-        sin_223[int(i / 2)] * d2 * this_p[c + 4];
+void AZR3::update_waveforms(TableSet& set, int number, 
+			    const float* controls) {
+  
+  int k, d, c, nd;
+  int channel = number - 1;
+  float delta[9];
+  int changed = 0;
+
+  if (number == 2) {
+    c = n_2_db1;
+    nd = 9;
+  }
+  else if (number == 3) {
+    c = n_3_db1;
+    nd = 5;
+  }
+  else {
+    c = n_1_db1;
+    nd = 9;
+    channel = 0;
+  }
+  
+  float* drawbars = set.drawbars[channel];
+  for (d = 0; d < nd; d++) {
+    delta[d] = controls[c + d] * drawbar_weights[d] - drawbars[d];
+    if (delta[d] != 0)
+      ++changed;
+  }
+  if (changed == 0)
+    return;
+  
+  // a full recalculation is cheaper if most drawbars have moved, and
+  // we do one every now and then anyway to get rid of rounding errors
+  if (2 * changed > nd || set.incremental_updates[channel] >= 64) {
+    calc_waveforms(set, number, controls);
+    return;
+  }
+  
+  float* t = &set.data[channel * MIPCHAINSIZE * TABLES_PER_CHANNEL];
+  const int (*folds)[9] = fold_levels[channel == 2 ? 1 : 0];
+  for (d = 0; d < nd; d++) {
+    if (delta[d] == 0)
+      continue;
+    for (k = 0; k < TABLES_PER_CHANNEL; k++) {
+      if (folds[k][d] >= 0)
+	add_scaled(t + k * MIPCHAINSIZE, harmonics[d][folds[k][d]], delta[d]);
+    }
+    drawbars[d] = controls[c + d] * drawbar_weights[d];
+  }
+  ++set.incremental_updates[channel];
+}
+
+
+void AZR3::prepare_tables(const float* controls, bool live) {
+  
+  float key[NUM_TABLE_CONTROLS];
+  for (int i = 0; i < NUM_TABLE_CONTROLS; ++i)
+    key[i] = controls[table_controls[i]];
+  
+  // nothing to do if a set has these tables already. Only the worker
+  // writes the keys, so we can read them in any state.
+  for (int s = 0; s < NUM_TABLESETS; ++s) {
+    if (m_tablesets[s].shape < 0)
+      continue;
+    int i;
+    for (i = 0; i < NUM_TABLE_CONTROLS; ++i) {
+      if (m_tablesets[s].key[i] != key[i])
+	break;
+    }
+    if (i == NUM_TABLE_CONTROLS)
+      return;
+  }
+  
+  // take a free set, or else the least recently used one that the audio
+  // thread isn't playing, and sets for old live values before programs
+  TableSet* set = 0;
+  while (!set) {
+    TableSet* best = 0;
+    int best_state = ts_free;
+    int best_rank = 0;
+    for (int s = 0; s < NUM_TABLESETS; ++s) {
+      TableSet& candidate = m_tablesets[s];
+      int state = candidate.state;
+      if (state != ts_free && state != ts_ready)
+	continue;
+      int rank = (state == ts_free ? 0 : candidate.live ? 1 : 2);
+      if (best && (rank > best_rank || (rank == best_rank && 
+				      candidate.last_used >= best->last_used)))
+	continue;
+      best = &candidate;
+      best_state = state;
+      best_rank = rank;
+    }
+    
+    // can't happen, the audio thread only uses two sets at a time
+    if (!best)
+      return;
+    
+    if (__sync_bool_compare_and_swap(&best->state, best_state, ts_building))
+      set = best;
+  }
+  
+  // incremental updates only work with the same basic waveforms
+  int shape = int(controls[n_shape] * (W_NUMOF - 1) + 1) - 1;
+  make_waveforms(shape);
+  for (int number = 1; number <= 3; ++number) {
+    if (set->shape == shape)
+      update_waveforms(*set, number, controls);
+    else
+      calc_waveforms(*set, number, controls);
+  }
+  set->shape = shape;
+  memcpy(set->key, key, sizeof(key));
+  set->live = live;
+  set->last_used = m_use_clock;
+  
+  // the audio thread may use the set as soon as it sees the new state
+  __sync_synchronize();
+  set->state = ts_ready;
+}
+
+
+void AZR3::select_tables() {
+  
+  if (tables_match_ports(*m_active_set))
+    return;
+  
+  // the voices can only fade out one set at a time. Cutting the fade
+  // short would drop the rest of the old tables in one sample and click,
+  // so the new tables wait until it is done. Without voices nothing is
+  // read from the old tables.
+  if (m_fading_set) {
+    if (!m_effect_only)
+      return;
+    finish_fade();
+  }
+  
+  for (int s = 0; s < NUM_TABLESETS; ++s) {
+    TableSet& set = m_tablesets[s];
+    if (set.state != ts_ready || !tables_match_ports(set))
+      continue;
+    if (!__sync_bool_compare_and_swap(&set.state, ts_ready, ts_active))
+      continue;
+    
+    // the worker may have started and finished a new set between the
+    // check and the swap
+    if (!tables_match_ports(set)) {
+      set.state = ts_ready;
+      continue;
     }
+    
+    TableSet* old = m_active_set;
+    m_active_set = &set;
+    set.last_used = ++m_use_clock;
+    
+    // the first tables are just switched on, there is nothing to fade from
+    if (old->shape < 0) {
+      n1.switch_tables(set.data - old->data, 1);
+      n1.end_fade();
+      old->state = ts_free;
+      return;
+    }
+    
+    // the voices read the same positions in the new tables and fade out
+    // the old ones
+    n1.switch_tables(set.data - old->data, m_fade_frames);
+    old->state = ts_fading;
+    m_fading_set = old;
+    m_fade_left = m_fade_frames;
+    return;
+  }
+}
+
+
+bool AZR3::tables_match_ports(const TableSet& set) {
+  for (int i = 0; i < NUM_TABLE_CONTROLS; ++i) {
+    if (*p(table_controls[i]) != set.key[i])
+      return false;
+  }
+  return true;
+}
+
+
+void AZR3::finish_fade() {
+  n1.end_fade();
+  __sync_synchronize();
+  m_fading_set->state = ts_ready;
+  m_fading_set = 0;
+}
+
+
+void AZR3::program_change(unsigned char number) {
+  
+  if (m_morph_state != morph_off)
+    stop_morph(false);
+  m_program_change = number;
+  
+  float values[kNumParams];
+  if (!read_program(number, values))
+    return;
+  
+  // the controls change right here, the wavetables too if the worker
+  // has computed them already
+  for (int i = 0; i < kNumParams; ++i)
+    *p(i) = values[i];
+  if (!m_changed_controls.push(kNumParams))
+    m_changes_lost = true;
+  m_automated_change = true;
+  select_tables();
+  
+  // the neighbours are the most likely programs to come next
+  if (number > 0)
+    m_prefetch.push(number - 1);
+  if (number < 127)
+    m_prefetch.push(number + 1);
+  wake_worker();
+}
+
+
+bool AZR3::tables_match(const TableSet& set, const float* controls) {
+  for (int i = 0; i < NUM_TABLE_CONTROLS; ++i) {
+    if (controls[table_controls[i]] != set.key[i])
+      return false;
+  }
+  return true;
+}
+
+
+void AZR3::start_morph(unsigned char from, unsigned char to, float seconds,
+		       int cc) {
+  
+  if (m_morph_state != morph_off)
+    stop_morph(false);
+  if (!read_program(from, m_morph_from) || !read_program(to, m_morph_to))
+    return;
+  
+  // start from the first program, as if it had been switched to
+  for (int i = 0; i < kNumParams; ++i)
+    *p(i) = m_morph_from[i];
+  if (!m_changed_controls.push(kNumParams))
+    m_changes_lost = true;
+  m_automated_change = true;
+  m_program_change = from;
+  
+  m_morph_program = to;
+  m_morph_cc = (cc >= 0 && cc < 128 ? cc : -1);
+  m_morph_pos = m_morph_reported = 0;
+  if (m_morph_cc >= 0) {
+    // don't jump when the controller does, take at least 20 ms
+    m_morph_target = 0;
+    m_morph_step = 1 / (0.02f * samplerate);
+  }
+  else {
+    m_morph_target = 1;
+    m_morph_step = (seconds > 0 ? 1 / (seconds * samplerate) : 1);
+  }
+  
+  m_prefetch.push(from);
+  m_prefetch.push(to);
+  wake_worker();
+  m_morph_state = morph_waiting;
+}
+
+
+void AZR3::begin_morph() {
+  
+  // the voices have to play the tables for the current controls first
+  if (m_fading_set || !tables_match_ports(*m_active_set))
+    return;
+  
+  TableSet* target = 0;
+  if (tables_match(*m_active_set, m_morph_to))
+    target = m_active_set;
+  else
+    target = claim_tables(m_morph_to);
+  if (!target)
+    return;
+  
+  // the drawbars may have been moved since the morph was started, so
+  // interpolate from what the voices are playing
+  for (int i = 0; i < NUM_TABLE_CONTROLS; ++i)
+    m_morph_from[table_controls[i]] = *p(table_controls[i]);
+  
+  // the voices play the target tables and mix in all of the old ones
+  if (target != m_active_set) {
+    TableSet* old = m_active_set;
+    ptrdiff_t offset = target->data - old->data;
+    m_active_set = target;
+    n1.switch_tables(offset, 1);
+    n1.set_fade(offset, 1, 0);
+    old->state = ts_fading;
+    m_morph_set = old;
+  }
+  
+  m_morph_state = morph_running;
+}
+
+
+AZR3::TableSet* AZR3::claim_tables(const float* controls) {
+  for (int s = 0; s < NUM_TABLESETS; ++s) {
+    TableSet& set = m_tablesets[s];
+    if (set.state != ts_ready || !tables_match(set, controls))
+      continue;
+    if (!__sync_bool_compare_and_swap(&set.state, ts_ready, ts_active))
+      continue;
+    
+    // the worker may have reused the set between the check and the swap
+    if (!tables_match(set, controls)) {
+      set.state = ts_ready;
+      continue;
+    }
+    set.last_used = ++m_use_clock;
+    return &set;
+  }
+  return 0;
+}
+
+
+void AZR3::update_morph_tables() {
+  
+  // if the programs have the same tables there is no m_morph_set, and
+  // the changes keep them the same
+  TableSet* to = m_active_set;
+  TableSet* from = m_morph_set;
+  bool to_ok = tables_match(*to, m_morph_to);
+  bool from_ok = (!from || tables_match(*from, m_morph_from));
+  if (to_ok && from_ok)
+    return;
+  
+  // wait until the worker has computed both
+  if (!to_ok && !(to = claim_tables(m_morph_to)))
+    return;
+  if (!from_ok && !(from = claim_tables(m_morph_from))) {
+    if (to != m_active_set)
+      to->state = ts_ready;
+    return;
+  }
+  
+  // both programs switch in the same sample and the crossfade goes on
+  // with the same weights, so only the changed drawbar jumps
+  TableSet* old_to = m_active_set;
+  TableSet* old_from = m_morph_set;
+  if (to != old_to) {
+    n1.switch_tables(to->data - old_to->data, 1);
+    m_active_set = to;
+  }
+  if (from) {
+    from->state = ts_fading;
+    m_morph_set = from;
+    n1.set_fade(to->data - from->data, 1 - m_morph_pos, 0);
+  }
+  else
+    n1.end_fade();
+  __sync_synchronize();
+  if (old_to != to)
+    old_to->state = ts_ready;
+  if (old_from && old_from != from)
+    old_from->state = ts_ready;
+}
+
+
+void AZR3::run_morph(uint32_t nframes) {
+  
+  // a timed morph ends after the block that reached the target program
+  if (m_morph_cc < 0 && m_morph_pos >= 1) {
+    stop_morph(true);
+    return;
+  }
+  
+  float start = m_morph_pos;
+  float step = m_morph_step * nframes;
+  if (m_morph_target - m_morph_pos > step)
+    m_morph_pos += step;
+  else if (m_morph_pos - m_morph_target > step)
+    m_morph_pos -= step;
+  else
+    m_morph_pos = m_morph_target;
+  
+  // the controls move once per block, the controls that are the same in
+  // both programs are left alone so they can still be changed, see
+  // update_morph_tables()
+  float pos = m_morph_pos;
+  if (pos != start) {
+    for (int i = 0; i < kNumParams; ++i) {
+      float from = m_morph_from[i];
+      float to = m_morph_to[i];
+      if (from == to)
+	continue;
+      if (discrete_controls[i])
+	*p(i) = (pos < 0.5f ? from : to);
+      else
+	*p(i) = from + pos * (to - from);
+    }
+  }
+  
+  // the wavetables are ramped per sample, this includes notes that have
+  // started since the last block
+  if (m_morph_set)
+    n1.set_fade(m_active_set->data - m_morph_set->data, 1 - start, 
+		(pos - start) / nframes);
+}
+
+
+void AZR3::stop_morph(bool finished) {
+  
+  // if the morph is interrupted the rest of the old tables are faded out
+  // like after a normal switch
+  if (m_morph_set) {
+    m_fading_set = m_morph_set;
+    m_morph_set = 0;
+    if (finished)
+      finish_fade();
     else {
-      t[i] += 
-        sin_4[i] * this_p[c + 3] + 
-        sin_223[i] * this_p[c + 4] +
-	sin_2[i] * this_p[c + 5] +
-	sin_135[i] * this_p[c + 6] + 
-        sin_113[i] * this_p[c + 7] +
-	sin_1[i] * this_p[c + 8];
-      t[i + WAVETABLESIZE] += 
-        sin_4[i] * this_p[c + 3] + 
-        sin_223[i] * this_p[c + 4] +
-	sin_2[i] * this_p[c + 5] +
-        sin_135[i] * this_p[c + 6] + 
-        sin_113[i] * this_p[c + 7] +
-        sin_1[int(i / 2)] * d2 * this_p[c + 8];
-      t[i + WAVETABLESIZE * 2] += 
-        sin_4[i] * this_p[c + 3] + 
-        sin_223[i] * this_p[c + 4] +
-        sin_2[i] * this_p[c + 5] +
-        sin_135[i] * this_p[c + 6] + 
-        sin_113[int(i / 2)] * d2 * this_p[c + 7] +
-        sin_1[int(i / 2)] * d2 * this_p[c + 8];
-      t[i + WAVETABLESIZE * 3] += 
-        sin_4[i] * this_p[c + 3] + 
-        sin_223[i] * this_p[c + 4] +
-        sin_2[i] * this_p[c + 5] +
-        sin_135[int(i / 2)] * d2 * this_p[c + 6] + 
-        sin_113[int(i / 2)] * d2 * this_p[c + 7] +
-        sin_1[int(i / 2)] * d2 * this_p[c + 8];
-      t[i + WAVETABLESIZE * 4] += 
-        sin_4[i] * this_p[c + 3] + 
-        sin_223[i] * this_p[c + 4] +
-        sin_2[int(i / 2)] * d2 * this_p[c + 5] +
-        sin_135[int(i / 2)] * d2 * this_p[c + 6] + 
-        sin_113[int(i / 2)] * d2 * this_p[c + 7] +
-        sin_1[int(i / 4)] * d4 * this_p[c + 8];
-      t[i + WAVETABLESIZE * 5] += 
-        sin_4[i] * this_p[c + 3] + 
-        sin_223[int(i / 2)] * d2 * this_p[c + 4] +
-        sin_2[int(i / 2)] * d2 * this_p[c + 5] +
-        sin_135[int(i / 2)] * d2 * this_p[c + 6] + 
-        sin_113[int(i / 4)] * d4 * this_p[c + 7] +
-        sin_1[int(i / 4)] * d4 * this_p[c + 8];
-      t[i + WAVETABLESIZE * 6]  += 
-        sin_4[i] * this_p[c + 3] + 
-        sin_223[int(i / 2)] * d2 * this_p[c + 4] +
-        sin_2[int(i / 2)] * d2 * this_p[c + 5] +
-        sin_135[int(i / 4)] * 0 * this_p[c + 6] + 
-        sin_113[int(i / 4)] * d4 * this_p[c + 7] +
-        sin_1[int(i / 4)] * d4 * this_p[c + 8];
-      t[i + WAVETABLESIZE * 7] += 
-        sin_4[int(i / 2)] * d2 * this_p[c + 3] + 
-        sin_223[int(i / 2)] * d2 * this_p[c + 4] +
-        sin_2[int(i / 4)] * d4 * this_p[c + 5] +
-        sin_135[int(i / 4)] * 0 * this_p[c + 6] + 
-        sin_113[int(i / 4)] * d4 * this_p[c + 7] +
-        sin_1[int(i / 8)] * d8 * this_p[c + 8];
-    } 
+      n1.set_fade(m_active_set->data - m_fading_set->data, 1 - m_morph_pos,
+		  (1 - m_morph_pos) / m_fade_frames);
+      m_fade_left = m_fade_frames;
+    }
+  }
+  m_morph_state = morph_off;
+  m_morph_tables_changed = false;
+  
+  // make sure that we end up with exactly the values of the program, or
+  // the tables won't match
+  if (finished) {
+    for (int i = 0; i < kNumParams; ++i) {
+      if (m_morph_from[i] != m_morph_to[i])
+	*p(i) = m_morph_to[i];
+    }
+    if (!m_changed_controls.push(kNumParams))
+      m_changes_lost = true;
+    m_automated_change = true;
+    m_program_change = m_morph_program;
   }
-  /*
-    The grown up source code viewer will find that sin_135 is only
-    folded once (/2). Well, I had terrible aliasing problems when
-    folding it twice (/4), and the easiest solution was to set it to
-    zero instead. You can't claim you actually heard it, can you?
-  */
-  wavetable[WAVETABLESIZE * 12] = 0;
+}
+
+
+void AZR3::map_controller(unsigned char channel, unsigned char number,
+			  unsigned char value) {
+  
+  // the channel mode messages can't be mapped
+  if (number >= 120)
+    return;
+  
+  // the controller that moves a morph doesn't do anything else, on any
+  // channel
+  if (m_morph_state != morph_off && number == m_morph_cc) {
+    m_morph_target = value / 127.0f;
+    return;
+  }
+  
+  // data entry sets the selected NRPN, if there is one. A controller that
+  // only sends the MSB should still reach both ends of the range, so the
+  // MSB is copied to the LSB until the real LSB arrives.
+  NrpnState& nrpn = m_nrpn[channel];
+  switch (number) {
+  case 99:
+    nrpn.msb = value;
+    return;
+  case 98:
+    nrpn.lsb = value;
+    return;
+  case 101:
+  case 100:
+    nrpn.msb = nrpn.lsb = -1;
+    break;
+  case 6:
+  case 38:
+    if (nrpn.msb >= 0 && nrpn.lsb >= 0 && 
+	(nrpn.msb != 127 || nrpn.lsb != 127)) {
+      if (number == 6)
+	nrpn.value = (value << 7) | value;
+      else
+	nrpn.value = (nrpn.value & ~0x7F) | value;
+      int param = (nrpn.msb << 7) | nrpn.lsb;
+      if (!learn_controller(MidiBinding::nrpn, channel, param))
+	set_mapped_controls(m_midi_map->find_nrpn(channel, param), 
+			    nrpn.value / 16383.0f);
+      return;
+    }
+    break;
+  }
+  
+  if (!learn_controller(MidiBinding::cc, channel, number))
+    set_mapped_controls(m_midi_map->find_cc(channel, number), value / 127.0f);
+}
+
+
+void AZR3::set_mapped_controls(int target, float value) {
+  while (target >= 0) {
+    CompiledMidiMap::Target& t = m_midi_map->get_target(target);
+    *p(t.control) = CompiledMidiMap::map_value(t, value, *p(t.control));
+    if (!m_changed_controls.push(t.control))
+      m_changes_lost = true;
+    m_automated_change = true;
+    target = t.next;
+  }
+}
+
+
+bool AZR3::learn_controller(int type, unsigned char channel, int number) {
+  int control = m_learn_control;
+  if (control < 0 || 
+      !__sync_bool_compare_and_swap(&m_learn_control, control, -1))
+    return false;
+  MidiBinding binding;
+  binding.type = type;
+  binding.channel = channel;
+  binding.number = number;
+  binding.control = control;
+  m_learned.push(binding);
+  m_automated_change = true;
+  return true;
+}
+
+
+bool AZR3::read_program(unsigned char number, float* values) {
+  Program& program = m_programs[number];
+  unsigned version = program.version;
+  __sync_synchronize();
+  if ((version & 1) || !program.stored)
+    return false;
+  memcpy(values, program.values, sizeof(program.values));
+  __sync_synchronize();
+  return program.version == version;
 }
 
 
@@ -1101,91 +1752,95 @@ void* AZR3::worker_function(void* arg) {
 
 
 void* AZR3::worker_function_real() {
-
-  bool change_mono = false;
-  bool change_shape = false;
-  bool change_organ1 = false;
-  bool change_organ2 = false;
-  bool change_organ3 = false;
   
-  do {
-    
-    // sleep for a while - we don't need to update the tables for _every_ 
-    // change
-    usleep(10000);
+  while (true) {
     
-    // wait until the audio thread is done writing
-    sem_wait(&m_qsem);
+    // sleep until there is something to do
+    while (sem_wait(&m_work_sem));
+    if (m_worker_quit)
+      break;
     
-    // read port changes from the queue until the semaphore would block
-    for (unsigned i = 0; i < kNumParams; ++i) {
-      if (slow_controls[i]) {
-	if (m_values[i].old_value != m_values[i].new_value) {
-	  if (i == n_mono)
-	    change_mono = true;
-	  else if (i >= n_1_db1 && i <= n_1_db9)
-	    change_organ1 = true;
-	  else if (i >= n_2_db1 && i <= n_2_db9)
-	    change_organ2 = true;
-	  else if (i >= n_3_db1 && i <= n_3_db5)
-	    change_organ3 = true;
-	  else if (i == n_shape)
-	    change_shape = true;
-	  
-	  m_values[i].old_value = m_values[i].new_value;
-        }
-      }
-    }
+    // the audio thread may have posted several times while we were busy,
+    // one do_work() picks up all the changes
+    while (!sem_trywait(&m_work_sem));
+    if (m_worker_quit)
+      break;
     
-    // done reading, release the semaphore
-    sem_post(&m_qsem);
-    
-    // act on the port changes
-    if (change_mono) {
-      pthread_mutex_lock(&m_notemaster_lock);
-      if (m_values[n_mono].old_value >= 0.5f)
-        n1.set_numofvoices(1);
-      else
-        n1.set_numofvoices(NUMOFVOICES);
-      pthread_mutex_unlock(&m_notemaster_lock);
-      change_mono = false;
-    }
+    do_work();
+  }
+  
+  return 0;
+}
+
+
+void AZR3::do_work() {
+
+  bool change_mono = false;
+  bool change_tables = false;
+  float controls[kNumParams];
+  float morph_controls[2][kNumParams];
+  
+  // wait until the audio thread is done writing
+  sem_wait(&m_qsem);
     
-    // this is not strictly safe - we are writing to the wavetable buffer
-    // while the audio thread may be reading from it. if you get crackly
-    // noises while moving the shape knob or the drawbars this might be 
-    // the cause.
-    if (change_shape) {
-      if (make_waveforms(int(m_values[n_shape].old_value * 
-			     (W_NUMOF - 1) + 1) - 1)) {
-        calc_waveforms(1);
-        calc_waveforms(2);
-        calc_waveforms(3);
+  // read port changes from the queue until the semaphore would block
+  for (unsigned i = 0; i < kNumParams; ++i) {
+    if (slow_controls[i]) {
+      if (m_values[i].old_value != m_values[i].new_value) {
+	if (i == n_mono)
+	  change_mono = true;
+	else
+	  change_tables = true;
+	m_values[i].old_value = m_values[i].new_value;
       }
-      change_shape = false;
-      change_organ1 = false;
-      change_organ2 = false;
-      change_organ3 = false;
     }
+    controls[i] = m_values[i].old_value;
+  }
+  bool change_morph = m_morph_request_pending;
+  if (change_morph) {
+    memcpy(morph_controls, m_morph_request, sizeof(morph_controls));
+    m_morph_request_pending = false;
+  }
     
-    if (change_organ1) {
-      calc_waveforms(1);
-      change_organ1 = false;
-    }
+  // done reading, release the semaphore
+  sem_post(&m_qsem);
     
-    if (change_organ2) {
-      calc_waveforms(2);
-      change_organ2 = false;
-    }
-        
-    if (change_organ3) {
-      calc_waveforms(3);
-      change_organ3 = false;
-    } 
-
-  } while (true);
+  // act on the port changes
+  if (change_mono) {
+    pthread_mutex_lock(&m_notemaster_lock);
+    if (m_values[n_mono].old_value >= 0.5f)
+      n1.set_numofvoices(1);
+    else
+      n1.set_numofvoices(NUMOFVOICES);
+    pthread_mutex_unlock(&m_notemaster_lock);
+  }
+    
+  // the new tables are computed in a set that the audio thread isn't
+  // playing, it switches to them when it sees that they are ready
+  if (change_tables)
+    prepare_tables(controls, true);
   
-  return 0;
+  // a running morph needs tables for both programs when a drawbar that
+  // it doesn't move has changed
+  if (change_morph) {
+    prepare_tables(morph_controls[0], true);
+    prepare_tables(morph_controls[1], true);
+  }
+  
+  // then the programs that we may have to switch to soon
+  unsigned char number;
+  while (m_prefetch.pop(number) || m_prepare.pop(number)) {
+    if (read_program(number, controls))
+      prepare_tables(controls, false);
+  }
+}
+
+
+void AZR3::wake_worker() {
+  if (m_worker_callback)
+    m_worker_callback(m_worker_data);
+  else
+    sem_post(&m_work_sem);
 }
 
 
@@ -1196,6 +1851,18 @@ bool AZR3::controls_has_changed() {
 }
 
 
+bool AZR3::get_changed_control(uint32_t& index) {
+  if (m_changed_controls.pop(index))
+    return true;
+  if (m_changes_lost) {
+    m_changes_lost = false;
+    index = kNumParams;
+    return true;
+  }
+  return false;
+}
+
+
 unsigned char AZR3::received_program_change() {
   unsigned char tmp = m_program_change;
   m_program_change = 255;
@@ -1203,14 +1870,126 @@ unsigned char AZR3::received_program_change() {
 }
 
 
-uint32_t AZR3::cc_map[128] = { 63, 49,  1,  2,  3,  4,  5, 10,  6,  7,  8,  9,
-			       11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22,
-			       23, 24, 25, 26, 27, 28, 29, 30, 31, 32, 33, 34,
-			       35, 36, 37, 38, 39, 40, 41, 42, 43, 44, 45, 46,
-			       47, 48, 50, 51, 52, 53, 54, 55, 56, 57, 58, 59,
-			       60, 61, 62, 63, 63, 63, 63, 63, 63, 63, 63, 63,
-			       63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63,
-			       63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63,
-			       63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63,
-			       63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63,
-			       63, 63, 63, 63, 63, 63,  0, 63 };
+void AZR3::set_program(unsigned char number, const float* values) {
+  if (number > 127)
+    return;
+  Program& program = m_programs[number];
+  ++program.version;
+  __sync_synchronize();
+  program.stored = (values != 0);
+  if (values)
+    memcpy(program.values, values, sizeof(program.values));
+  __sync_synchronize();
+  ++program.version;
+}
+
+
+void AZR3::prepare_program(unsigned char number) {
+  if (number < 128 && m_prepare.push(number))
+    m_prepare_pending = true;
+}
+
+
+void AZR3::morph(unsigned char from, unsigned char to, float seconds,
+		 int cc) {
+  if (from > 127 || to > 127)
+    return;
+  MorphRequest request = { from, to, seconds, cc };
+  m_morph_requests.push(request);
+}
+
+
+void AZR3::set_midi_map(const MidiMap& map) {
+  CompiledMidiMap* old;
+  while (m_old_midi_maps.pop(old))
+    delete old;
+  CompiledMidiMap* compiled = new CompiledMidiMap(map);
+  __sync_synchronize();
+  
+  // if the audio thread hasn't taken the previous map it never will
+  old = __sync_lock_test_and_set(&m_next_midi_map, compiled);
+  delete old;
+}
+
+
+void AZR3::midi_learn(int control) {
+  m_learn_control = (control < kNumParams ? control : -1);
+}
+
+
+bool AZR3::get_learned_binding(MidiBinding& binding) {
+  return m_learned.pop(binding);
+}
+
+
+bool AZR3::get_midi_timing(MidiTiming& timing) {
+  unsigned version = m_timing_version;
+  __sync_synchronize();
+  if (version & 1)
+    return false;
+  timing = m_timing;
+  __sync_synchronize();
+  return m_timing_version == version;
+}
+
+
+void AZR3::reset_midi_timing() {
+  m_timing_reset = true;
+}
+
+
+void AZR3::set_seed(uint32_t seed) {
+  n1.set_seed(seed);
+}
+
+
+void AZR3::set_rotor_quality(int quality) {
+  rotor.set_quality(quality);
+}
+
+
+void AZR3::set_effect_only(bool effect_only) {
+  m_effect_only = effect_only;
+}
+
+
+void AZR3::set_worker_callback(WorkerCallback callback, void* data) {
+  m_worker_callback = callback;
+  m_worker_data = data;
+}
+
+
+const uint32_t AZR3::table_controls[NUM_TABLE_CONTROLS] = {
+  n_shape,
+  n_1_db1, n_1_db2, n_1_db3, n_1_db4, n_1_db5, n_1_db6, n_1_db7, n_1_db8, 
+  n_1_db9,
+  n_2_db1, n_2_db2, n_2_db3, n_2_db4, n_2_db5, n_2_db6, n_2_db7, n_2_db8,
+  n_2_db9,
+  n_3_db1, n_3_db2, n_3_db3, n_3_db4, n_3_db5
+};
+
+
+const char* const control_symbols[kNumParams] = {
+  "mono", "click", "bender", "shape", "perc", "percvol", "percfade",
+  "vol1", "vol2", "vol3", "master",
+  "1_perc", "1_db1", "1_db2", "1_db3", "1_db4", "1_db5", "1_db6", "1_db7",
+  "1_db8", "1_db9", "1_vibrato", "1_vstrength", "1_vmix",
+  "2_perc", "2_db1", "2_db2", "2_db3", "2_db4", "2_db5", "2_db6", "2_db7",
+  "2_db8", "2_db9", "2_vibrato", "2_vstrength", "2_vmix",
+  "3_perc", "3_db1", "3_db2", "3_db3", "3_db4", "3_db5",
+  "mrvalve", "drive", "set", "tone", "mix", "speakers", "speed",
+  "l_slow", "l_fast", "u_slow", "u_fast", "belt", "spread", "complex",
+  "pedalspeed", "splitpoint", "sustain", "1_sustain", "2_sustain",
+  "3_sustain"
+};
+
+
+const float default_values[kNumParams] = {
+  0.00, 0.20, 0.20, 0.00, 0.00, 0.75, 0.50, 0.60, 0.60,
+  0.00, 0.22, 0.00, 1.00, 1.00, 0.00, 0.00, 0.00, 0.00,
+  0.00, 0.00, 0.00, 0.00, 0.30, 0.35, 0.00, 0.00, 0.00,
+  0.00, 0.00, 0.00, 0.00, 0.00, 0.00, 0.00, 0.00, 0.00,
+  0.00, 0.00, 0.00, 0.00, 0.00, 0.00, 0.00, 0.00, 0.40,
+  0.00, 0.66, 0.00, 1.00, 0.00, 0.10, 0.65, 0.05, 0.78,
+  0.50, 0.50, 0.00, 0.00, 0.00, 0.00, 0.00, 0.00, 0.00
+};
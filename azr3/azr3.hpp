@@ -30,6 +30,9 @@
 
 #include "voice_classes.hpp"
 #include "globals.hpp"
+#include "midimap.hpp"
+#include "ringbuffer.hpp"
+#include "rotor.hpp"
 
 
 enum {
@@ -45,6 +48,121 @@ enum {
 };
 
 
+/** The port indices after the controls, as used by the LV2 plugin. The
+    engine itself only reads the controls from its ports, the MIDI and audio
+    buffers are passed to process() in a ProcessContext. The dry outputs for
+    the manuals come after the vibrato, the pre-speaker output after the
+    distortion, and the speaker outputs only carry the rotary speaker and
+    are silent when the speakers are switched off. All outputs except the
+    inputs are scaled by the master volume. */
+enum {
+  port_midi = kNumParams,
+  port_left,
+  port_right,
+  port_in_left,
+  port_in_right,
+  port_upper,
+  port_lower,
+  port_pedal,
+  port_prespeaker,
+  port_speaker_left,
+  port_speaker_right,
+  kNumPorts
+};
+
+
+/** A MIDI event for AZR3::process(). The data is owned by the host and
+    only has to stay valid during the call. */
+struct MidiEvent {
+  /** The frame in the cycle, events must be sorted by time. */
+  uint32_t time;
+  uint32_t size;
+  const unsigned char* data;
+};
+
+
+/** The buffers and the timing for one call to AZR3::process(). The host
+    fills this in every cycle with its own buffers, so the engine renders
+    straight into them. The MIDI input and the main outputs must be set,
+    all other buffers may be 0 and are skipped then. The engine never
+    touches the host's MIDI API, the host translates its events into a
+    MidiEvent array. */
+struct ProcessContext {
+  
+  ProcessContext() 
+    : nframes(0), events(0), event_count(0), prespeaker(0), 
+      transport_frame(0), transport_rolling(false) {
+    input[0] = input[1] = 0;
+    output[0] = output[1] = 0;
+    dry[0] = dry[1] = dry[2] = 0;
+    speaker[0] = speaker[1] = 0;
+  }
+  
+  uint32_t nframes;
+  const MidiEvent* events;
+  uint32_t event_count;
+  const float* input[2];
+  float* output[2];
+  /** The dry outputs for the upper and lower manuals and the pedal. */
+  float* dry[3];
+  float* prespeaker;
+  float* speaker[2];
+  /** The host transport position at the first frame. The engine doesn't
+      use it yet. */
+  uint64_t transport_frame;
+  bool transport_rolling;
+};
+
+
+/** Statistics about when the engine has handled the MIDI events, from
+    AZR3::get_midi_timing(). The histograms have the same buckets: bucket
+    0 counts 0 frames, bucket i counts 2^(i-1) to 2^i - 1 frames and the
+    last bucket also counts everything above that. */
+struct MidiTiming {
+  
+  enum { num_buckets = 16 };
+  
+  MidiTiming() {
+    reset();
+  }
+  
+  void reset() {
+    cycles = events = dropped = late = max_latency = max_nframes = 0;
+    min_nframes = 0xFFFFFFFF;
+    for (int i = 0; i < num_buckets; ++i)
+      offsets[i] = note_latency[i] = 0;
+  }
+  
+  /** The bucket for a number of frames. */
+  static int bucket(uint32_t frames) {
+    int b = 0;
+    while (frames && b < num_buckets - 1) {
+      frames >>= 1;
+      ++b;
+    }
+    return b;
+  }
+  
+  uint32_t cycles;
+  uint32_t events;
+  /** Events that were after the end of their cycle, or arrived while the
+      engine couldn't render. They are ignored. */
+  uint32_t dropped;
+  /** Events that were handled after their frame because the events
+      weren't sorted by time. */
+  uint32_t late;
+  uint32_t max_latency;
+  uint32_t min_nframes;
+  uint32_t max_nframes;
+  /** The frames of the events in their cycles. */
+  uint32_t offsets[num_buckets];
+  /** The frames from the time of a note on to the first envelope block
+      where its voice is audible. That is more than 0 when the event was
+      late or the voice was stolen and had to fade out its old note. */
+  uint32_t note_latency[num_buckets];
+};
+
+
 class AZR3 {
 public:
  
@@ -58,23 +176,199 @@ public:
   
   void connect_port(uint32_t port, void* buffer);
   
-  void run(uint32_t nframes);
+  /** Render one cycle into the buffers in @c ctx. The controls are still
+      read from the ports connected with connect_port(). */
+  void process(const ProcessContext& ctx);
   
+  /** Returns true if MIDI has changed any controls since the last call.
+      Call this from the audio thread after process(). */
   bool controls_has_changed();
   
+  /** Get the index of a control that MIDI has changed. Call this from one
+      thread that isn't the audio thread, it returns false when there are
+      no more changes. After a program change, or if the queue has been 
+      full and changes were lost, @c index is set to kNumParams once and
+      all controls should be reread. */
+  bool get_changed_control(uint32_t& index);
+  
+  /** Returns the number of the last MIDI program change, or 255 if there
+      hasn't been one since the last call. If the program has been stored
+      with set_program() the engine has switched to it already. */
   unsigned char received_program_change();
+  
+  /** Store the control values for a program, or forget it if @c values
+      is 0. A MIDI program change for a stored program is handled by the
+      engine itself: it writes the values to the control ports and
+      crossfades to the new wavetables at the frame of the event. Call
+      this and prepare_program() from one thread that isn't the audio 
+      thread, it is OK to do it while the engine is running. */
+  void set_program(unsigned char number, const float* values);
+  
+  /** Ask the worker to compute the wavetables for a stored program in the
+      background, so a switch to it later doesn't have to wait for them.
+      The engine does this itself for the neighbours of a program that
+      MIDI switches to. */
+  void prepare_program(unsigned char number);
+  
+  /** Morph from one stored program to another. The continuous controls
+      are interpolated, the wavetables of the two programs are crossfaded
+      and the switches flip halfway. If @c cc is a MIDI controller number
+      the controller moves the morph and it lasts until the next program
+      change or morph, otherwise it takes @c seconds and ends with a 
+      program change to @c to. The engine starts from @c from right away,
+      and morphs as soon as the worker has the wavetables ready. Call this
+      from the same thread as set_program(). */
+  void morph(unsigned char from, unsigned char to, float seconds, 
+	     int cc = -1);
+  
+  /** Replace the MIDI map that decides which controls the MIDI
+      controllers move. The map is compiled here and the audio thread
+      switches to it at the start of the next cycle. Until this is called
+      the engine uses the bindings of the original AZR-3. Call this, 
+      midi_learn() and get_learned_binding() from one thread that isn't
+      the audio thread. */
+  void set_midi_map(const MidiMap& map);
+  
+  /** Bind the next MIDI controller that moves to @c control, or stop
+      waiting for one if @c control is -1. That controller doesn't change
+      anything itself, the binding is returned by get_learned_binding()
+      and is used when it has been added to a map for set_midi_map(). */
+  void midi_learn(int control);
+  
+  /** Get a binding that midi_learn() has found. Returns false if there
+      isn't one. */
+  bool get_learned_binding(MidiBinding& binding);
+  
+  /** Copy the MIDI timing statistics to @c timing. Returns false if the
+      audio thread was changing them, try again a bit later then. */
+  bool get_midi_timing(MidiTiming& timing);
+  
+  /** Clear the MIDI timing statistics at the start of the next cycle. */
+  void reset_midi_timing();
+  
+  /** Seed the noise generators used for the key click. Two engines with
+      the same seed, controls and input render the same output. Call this
+      before activate() or from the audio thread. */
+  void set_seed(uint32_t seed);
+  
+  /** Choose the rotary speaker engine, one of the ROTOR_ constants in
+      rotor.hpp. The default is ROTOR_CLASSIC. Call this before activate()
+      or from the audio thread. */
+  void set_rotor_quality(int quality);
+  
+  /** Bypass the voices and only run the input ports through the effects.
+      Call this before activate() or from the audio thread. */
+  void set_effect_only(bool effect_only);
+  
+  /** The type of the function that set_worker_callback() takes. */
+  typedef void (*WorkerCallback)(void* data);
+  
+  /** Let the host run the non-RT safe work instead of a thread of our own,
+      for hosts that have a worker thread already (like the LV2 worker
+      extension). When this is set, activate() doesn't start a thread and
+      process() calls @c callback when some work is needed. The host must
+      then call do_work() soon from a thread where it is OK to block. Call
+      this before activate(). */
+  void set_worker_callback(WorkerCallback callback, void* data);
+  
+  /** Act on the slow control changes that process() has queued, for
+      example by computing new wavetables. Don't call this from the audio
+      thread. */
+  void do_work();
  
 protected: 
+  
+  /** Post m_work_sem or call the worker callback. */
+  void wake_worker();
  
   /** Generate the basic tonewheel waveforms that are used to build the
       three different organ sounds. Should only be called from the worker 
       thread. */
   bool make_waveforms(int shape);
  
-  /** Compute one of the three organ sounds using the basic tonewheel waveforms
-      and the drawbar settings for that organ section. Should only be called
-      from the worker thread. */
-  void calc_waveforms(int number);
+  struct TableSet;
+ 
+  /** Compute one of the three organ sounds in @c set using the basic
+      tonewheel waveforms and the drawbar settings in @c controls for that
+      organ section. Should only be called from the worker thread. */
+  void calc_waveforms(TableSet& set, int number, const float* controls);
+ 
+  /** Update one of the three organ sounds after drawbar changes by only
+      adding the difference for the drawbars that have moved. Falls back to
+      calc_waveforms() when that would be cheaper, or when too many small
+      updates have been done in a row. Should only be called from the 
+      worker thread. */
+  void update_waveforms(TableSet& set, int number, const float* controls);
+  
+  /** Make sure that there is a table set for the shape and drawbars in
+      @c controls, computing it in the least recently used free set if 
+      there isn't. @c live is true for the current control values and
+      false for a program that we may switch to later. Should only be 
+      called from the worker thread. */
+  void prepare_tables(const float* controls, bool live);
+  
+  /** Switch to a ready table set that matches the control ports, if the
+      active one doesn't. Only call this from the audio thread. */
+  void select_tables();
+  
+  /** Returns true if the tables in @c set were computed for the values
+      in the control ports. */
+  bool tables_match_ports(const TableSet& set);
+  
+  /** Stop fading out the old tables and give them back to the worker.
+      Only call this from the audio thread. */
+  void finish_fade();
+  
+  /** Switch to a program that has been stored with set_program(), in the
+      audio thread. */
+  void program_change(unsigned char number);
+  
+  /** Returns true if the tables in @c set were computed for @c controls,
+      an array with all control values. */
+  bool tables_match(const TableSet& set, const float* controls);
+  
+  /** Set up a morph in the audio thread. */
+  void start_morph(unsigned char from, unsigned char to, float seconds,
+		   int cc);
+  
+  /** Start crossfading if the tables for both programs are ready. */
+  void begin_morph();
+  
+  /** Take a set that is ready and has the tables for @c controls, an
+      array with all control values, for the audio thread. Returns 0 if
+      there is none. */
+  TableSet* claim_tables(const float* controls);
+  
+  /** Move the voices to new tables for both programs of a running morph
+      when a control that the morph doesn't move has changed and the
+      worker has computed them. */
+  void update_morph_tables();
+  
+  /** Move the morph and interpolate the controls for the next @c nframes
+      frames, before the voices render them. */
+  void run_morph(uint32_t nframes);
+  
+  /** End the morph. If @c finished is true the controls are set to the
+      values of the target program. */
+  void stop_morph(bool finished);
+  
+  /** Set the controls that a MIDI controller is bound to, keeping track of
+      the NRPN that is selected on each channel. Only call this from the
+      audio thread. */
+  void map_controller(unsigned char channel, unsigned char number,
+		      unsigned char value);
+  
+  /** Set the controls in the chain of map targets that starts at
+      @c target to the controller value @c value, in [0, 1]. */
+  void set_mapped_controls(int target, float value);
+  
+  /** Returns true if midi_learn() was waiting for a controller and has
+      taken this one. */
+  bool learn_controller(int type, unsigned char channel, int number);
+  
+  /** Copy a stored program to @c values. Returns false if the program
+      isn't stored or if it was changed while we were reading it. */
+  bool read_program(unsigned char number, float* values);
  
   /** Compute click coefficients. */
   void calc_click();
@@ -84,8 +378,9 @@ protected:
       parameter should be a pointer to an AZR3 object. */
   static void* worker_function(void* arg);
  
-  /** This function is executed in a worker thread and does non-RT safe things
-      like computing wavetables. */
+  /** This function is executed in the worker thread when there is no
+      worker callback. It sleeps until process() posts m_work_sem and then
+      calls do_work(), until deactivate() sets m_worker_quit. */
   void* worker_function_real();
  
 protected:
@@ -102,8 +397,8 @@ protected:
   }
 
   
-  /** This array holds pointers to the port buffers. */
-  void* m_ports[kNumParams + 3];
+  /** This array holds pointers to the control port buffers. */
+  void* m_ports[kNumParams];
   
   /** The main notemaster object. */
   notemaster n1;
@@ -135,20 +430,15 @@ protected:
   /** The master waveform. */
   float tonewheel[WAVETABLESIZE];
   
-  /** Resized waveforms at different pitches, one for each drawbar. */
-  float sin_16[WAVETABLESIZE];
-  float sin_8[WAVETABLESIZE];
-  float sin_513[WAVETABLESIZE];
-  float sin_4[WAVETABLESIZE];
-  float sin_223[WAVETABLESIZE];
-  float sin_2[WAVETABLESIZE];
-  float sin_135[WAVETABLESIZE];
-  float sin_113[WAVETABLESIZE];
-  float sin_1[WAVETABLESIZE];
-
-  // TABLES_PER_CHANNEL tables per channel; 3 channels; 1 spare table
+  /** Resized waveforms at different pitches, one for each drawbar, from
+      16' to 1'. The second index is the number of octaves the waveform
+      has been folded down (with lower volume), see calc_waveforms(). 
+      Each one includes all the band-limited mip levels. */
+  float harmonics[9][4][MIPCHAINSIZE];
+
+  // TABLES_PER_CHANNEL tables per channel; 3 channels. Each table is
+  // MIPCHAINSIZE floats long, with all the mip levels.
 #define TABLES_PER_CHANNEL 8
-  volatile float wavetable[WAVETABLESIZE*TABLES_PER_CHANNEL*3+1]; 
 
   lfo  vlfo;
   delay vdelay1, vdelay2;
@@ -167,19 +457,25 @@ protected:
   float oldspread, spread, spread2;
   float cross1;
   float lspeed, uspeed;
-  float er_r, er_r_before, er_l, er_feedback;
+  v2f er;		// early reflections, { right, left }
+  float er_feedback;
   float llfo_out, llfo_nout, llfo_d_out, llfo_d_nout;
   float lfo_out, lfo_nout, lfo_d_out, lfo_d_nout;
   bool lfos_ok;
   filt1 split;
   filt1 horn_filt, damp;
-  delay wand_r, wand_l, delay1, delay2, delay3, delay4;
+  stereo_delay wand;
+  quad_delay rdelays;
   lfo  lfo1, lfo2, lfo3, lfo4;
+  rotor_motor horn_motor, drum_motor;
+  rotary rotor;
+  
+  bool m_effect_only;
 
   int   last_shape;
-  float  last_r, last_l;
+  v2f  last_rl;
 
-  filt_allpass allpass_l[4], allpass_r[4];
+  stereo_allpass allpass[4];
  
   bool pedal;
  
@@ -201,10 +497,153 @@ protected:
   
   pthread_t m_worker;
   
-  static uint32_t cc_map[128];
+  /** Posted by the audio thread when there are new slow control values,
+      and by deactivate() to wake the worker up so it can quit. Posting a
+      semaphore is safe in the audio thread, unlike signalling a condition
+      variable, which needs a mutex. */
+  sem_t m_work_sem;
+  volatile bool m_worker_quit;
   
   bool m_automated_change;
   unsigned char m_program_change;
+  
+  WorkerCallback m_worker_callback;
+  void* m_worker_data;
+  
+  /** The indices of the controls that MIDI has changed, for the GUI. */
+  ringbuffer<uint32_t, 256> m_changed_controls;
+  volatile bool m_changes_lost;
+  
+  // the number of table sets that we keep around, at most two of them
+  // are used by the audio thread at any time
+#define NUM_TABLESETS 8
+  
+  // the shape and the drawbars, the controls that the wavetables depend on
+#define NUM_TABLE_CONTROLS 24
+  static const uint32_t table_controls[NUM_TABLE_CONTROLS];
+  
+  /** Who owns a table set. The audio thread and the worker thread take
+      sets with an atomic compare-and-swap of the state, the worker only
+      writes to sets that it has taken and the audio thread only plays 
+      sets that it has taken. */
+  enum TableSetState {
+    ts_free,
+    ts_ready,
+    ts_building,
+    ts_active,
+    ts_fading
+  };
+  
+  /** A complete set of wavetables for all three channels and the control
+      values that it was computed for. */
+  struct TableSet {
+    float data[MIPCHAINSIZE*TABLES_PER_CHANNEL*3];
+    /** The values of the controls in table_controls. */
+    float key[NUM_TABLE_CONTROLS];
+    /** The weighted drawbar values that are currently mixed into the
+	wavetables for each channel, and the number of incremental updates
+	done since the last full recalculation. */
+    float drawbars[3][9];
+    int incremental_updates[3];
+    /** The waveform shape, or -1 if nothing has been computed yet. */
+    int shape;
+    /** True if the set was computed for the controls the user was playing
+	with, those sets are reused before the ones for stored programs. */
+    bool live;
+    volatile unsigned last_used;
+    volatile int state;
+  } m_tablesets[NUM_TABLESETS];
+  
+  /** The set that new notes use and the one that the voices are fading
+      out from, if any. Only used in the audio thread. */
+  TableSet* m_active_set;
+  TableSet* m_fading_set;
+  int m_fade_frames;
+  int m_fade_left;
+  volatile unsigned m_use_clock;
+  
+  /** A program stored with set_program(). The version is odd while the
+      values are being written, so readers in other threads can tell if
+      they got a consistent copy. */
+  struct Program {
+    volatile unsigned version;
+    volatile bool stored;
+    float values[kNumParams];
+  } m_programs[128];
+  
+  /** Programs that the worker should compute tables for, from the audio 
+      thread and from prepare_program(). */
+  ringbuffer<unsigned char, 16> m_prefetch;
+  ringbuffer<unsigned char, 16> m_prepare;
+  volatile bool m_prepare_pending;
+  
+  /** True for the controls that are switched instead of interpolated when
+      morphing. */
+  bool discrete_controls[kNumParams];
+  
+  struct MorphRequest {
+    unsigned char from;
+    unsigned char to;
+    float seconds;
+    int cc;
+  };
+  
+  enum MorphState {
+    morph_off,
+    morph_waiting,
+    morph_running
+  };
+  
+  /** Morphs requested with morph(). */
+  ringbuffer<MorphRequest, 4> m_morph_requests;
+  
+  /** The state of the current morph, only used in the audio thread. The
+      voices play m_active_set, the tables of the target program, and mix
+      in m_morph_set with the weight 1 - m_morph_pos. If both programs use
+      the same tables m_morph_set is 0. */
+  int m_morph_state;
+  float m_morph_from[kNumParams];
+  float m_morph_to[kNumParams];
+  unsigned char m_morph_program;
+  int m_morph_cc;
+  TableSet* m_morph_set;
+  float m_morph_pos;
+  float m_morph_target;
+  float m_morph_step;
+  float m_morph_reported;
+  /** Set when a control that is the same in both programs has changed
+      while morphing, so both need new tables. */
+  bool m_morph_tables_changed;
+  
+  /** The controls of both programs of the morph that the worker should
+      compute tables for. Protected by m_qsem like m_values. */
+  float m_morph_request[2][kNumParams];
+  bool m_morph_request_pending;
+  
+  /** The MIDI map that the audio thread uses, the next one from 
+      set_midi_map() if the audio thread hasn't taken it yet, and the old
+      ones that set_midi_map() should delete. */
+  CompiledMidiMap* m_midi_map;
+  CompiledMidiMap* volatile m_next_midi_map;
+  ringbuffer<CompiledMidiMap*, 16> m_old_midi_maps;
+  
+  /** The NRPN that is selected on each channel, with -1 for the parts
+      that haven't been sent, and the 14 bit data entry value. */
+  struct NrpnState {
+    int msb;
+    int lsb;
+    int value;
+  } m_nrpn[16];
+  
+  /** The MIDI timing statistics, only written by the audio thread. The
+      version is odd while a cycle is changing them. */
+  MidiTiming m_timing;
+  volatile unsigned m_timing_version;
+  volatile bool m_timing_reset;
+  
+  /** The control that midi_learn() wants a controller for, or -1. */
+  volatile int m_learn_control;
+  ringbuffer<MidiBinding, 4> m_learned;
 };
 
 
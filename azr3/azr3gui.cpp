@@ -19,6 +19,7 @@
 
 ****************************************************************************/
 
+#include <algorithm>
 #include <cassert>
 #include <iomanip>
 #include <sstream>
@@ -35,11 +36,25 @@ using namespace std;
 using namespace sigc;
 
 
+namespace {
+  
+  // the time between two redraws of a widget, in milliseconds
+  const unsigned frame_interval = 20;
+  
+}
+
+
+std::vector<Gtk::Widget*> AZR3GUI::pending_redraws;
+std::map<std::string, AZR3GUI::CachedPixmap> AZR3GUI::pixmap_cache;
+
+
 AZR3GUI::AZR3GUI()
   : m_showing_fx_controls(true),
+    m_voice_page_built(false),
     m_current_program(0),
     m_splitkey(0),
-    m_adj(kNumControls, 0) {
+    m_adj(kNumControls, 0),
+    m_values(kNumControls, 0.5) {
   
   m_fbox.set_has_window(true);
   m_vbox.set_has_window(true);
@@ -47,13 +62,10 @@ AZR3GUI::AZR3GUI()
   m_voice_widgets.push_back(&m_vbox);
   
   RefPtr<Pixmap> pixmap = pixmap_from_file(DATADIR "/panelfx.png");
-  RefPtr<Pixmap> voicepxm = pixmap_from_file(DATADIR "/voice.png");
   
   int w, h;
   pixmap->get_size(w, h);
   m_fbox.set_size_request(w, h);
-  voicepxm->get_size(w, h);
-  m_vbox.set_size_request(w, h);
   RefPtr<Style> s = m_fbox.get_style()->copy();
   s->set_bg_pixmap(STATE_NORMAL, pixmap);
   s->set_bg_pixmap(STATE_ACTIVE, pixmap);
@@ -61,13 +73,6 @@ AZR3GUI::AZR3GUI()
   s->set_bg_pixmap(STATE_SELECTED, pixmap);
   s->set_bg_pixmap(STATE_INSENSITIVE, pixmap);
   m_fbox.set_style(s);
-  s = m_vbox.get_style()->copy();
-  s->set_bg_pixmap(STATE_NORMAL, voicepxm);
-  s->set_bg_pixmap(STATE_ACTIVE, voicepxm);
-  s->set_bg_pixmap(STATE_PRELIGHT, voicepxm);
-  s->set_bg_pixmap(STATE_SELECTED, voicepxm);
-  s->set_bg_pixmap(STATE_INSENSITIVE, voicepxm);
-  m_vbox.set_style(s);
 
   // add the display
   m_tbox = add_textbox(m_fbox, pixmap, 391, 19, 3, 140, 39);
@@ -179,20 +184,6 @@ AZR3GUI::AZR3GUI()
   m_fx_widgets.push_back(add_switch(m_fbox, n_pedalspeed, 
 				    510, 331, Switch::Mini));
 
-  // mode switcher 2
-  Widget* eb2 = add_clickbox(m_vbox, 14, 53, 14, 44);
-  eb2->signal_button_press_event().
-    connect(sigc::hide(sigc::bind(sigc::bind(mem_fun(*this, &AZR3GUI::change_mode), 
-				 std::ref(m_fbox)), true)));
-
-  // vibrato controls
-  add_switch(m_vbox, n_1_vibrato, 39, 17, Switch::Green);
-  add_knob(m_vbox, voicepxm, n_1_vstrength, 0, 1, 0.5, 88, 37, 0, 100, false);
-  add_knob(m_vbox, voicepxm, n_1_vmix, 0, 1, 0.5, 176, 37, 0, 100, false);
-  add_switch(m_vbox, n_2_vibrato, 302, 17, Switch::Green);
-  add_knob(m_vbox, voicepxm, n_2_vstrength, 0, 1, 0.5, 352, 37, 0, 100, false);
-  add_knob(m_vbox, voicepxm, n_2_vmix, 0, 1, 0.5, 440, 37, 0, 100, false);
-  
   pack_start(m_fbox);
     
   splitpoint_changed();
@@ -201,6 +192,8 @@ AZR3GUI::AZR3GUI()
   
 
 void AZR3GUI::set_control(uint32_t port, float value) {
+  if (port < m_values.size())
+    m_values[port] = value;
   if (port < m_adj.size() && m_adj[port])
     m_adj[port]->set_value(value);
 }
@@ -245,15 +238,42 @@ void AZR3GUI::clear_programs() {
 
 
 Glib::RefPtr<Gdk::Pixmap> AZR3GUI::pixmap_from_file(const std::string& file, RefPtr<Bitmap>* bitmap) {
-  RefPtr<Pixbuf> pixbuf = Pixbuf::create_from_file(file);
-  RefPtr<Pixmap> pixmap;
-  if (bitmap)
-    pixbuf->render_pixmap_and_mask(pixmap, *bitmap, 255);
-  else {
-    RefPtr<Bitmap> tmp;
-    pixbuf->render_pixmap_and_mask(pixmap, tmp, 255);
+  std::map<string, CachedPixmap>::const_iterator iter = 
+    pixmap_cache.find(file);
+  if (iter == pixmap_cache.end()) {
+    RefPtr<Pixbuf> pixbuf = Pixbuf::create_from_file(file);
+    CachedPixmap cp;
+    pixbuf->render_pixmap_and_mask(cp.pixmap, cp.bitmap, 255);
+    iter = pixmap_cache.insert(make_pair(file, cp)).first;
   }
-  return pixmap;
+  if (bitmap)
+    *bitmap = iter->second.bitmap;
+  return iter->second.pixmap;
+}
+
+
+void AZR3GUI::queue_redraw(Gtk::Widget* widget) {
+  if (find(pending_redraws.begin(), pending_redraws.end(), widget) != 
+      pending_redraws.end())
+    return;
+  if (pending_redraws.empty())
+    Glib::signal_timeout().connect(sigc::ptr_fun(&AZR3GUI::redraw_tick), 
+				   frame_interval);
+  pending_redraws.push_back(widget);
+}
+
+
+void AZR3GUI::cancel_redraw(Gtk::Widget* widget) {
+  pending_redraws.erase(remove(pending_redraws.begin(), pending_redraws.end(),
+			       widget), pending_redraws.end());
+}
+
+
+bool AZR3GUI::redraw_tick() {
+  for (unsigned i = 0; i < pending_redraws.size(); ++i)
+    pending_redraws[i]->queue_draw();
+  pending_redraws.clear();
+  return false;
 }
 
   
@@ -358,6 +378,10 @@ Knob* AZR3GUI::add_knob(Fixed& fbox, RefPtr<Pixmap>& pm, size_t port,
     assert(m_adj[port] == 0);
     m_adj[port] = &knob->get_adjustment();
   }
+  if (port < kNumParams)
+    knob->signal_button_press_event().
+      connect(sigc::bind(mem_fun(*this, &AZR3GUI::learn_clicked), port), 
+	      false);
   return knob;
 }
 
@@ -387,6 +411,10 @@ Drawbar* AZR3GUI::add_drawbar(Fixed& fbox, RefPtr<Pixmap>& pm, size_t port,
     assert(m_adj[port] == 0);
     m_adj[port] = &db->get_adjustment();
   }
+  if (port < kNumParams)
+    db->signal_button_press_event().
+      connect(sigc::bind(mem_fun(*this, &AZR3GUI::learn_clicked), port), 
+	      false);
   return db;
 }
 
@@ -402,6 +430,10 @@ Switch* AZR3GUI::add_switch(Fixed& fbox, size_t port,
     assert(m_adj[port] == 0);
     m_adj[port] = &sw->get_adjustment();
   }
+  if (port < kNumParams)
+    sw->signal_button_press_event().
+      connect(sigc::bind(mem_fun(*this, &AZR3GUI::learn_clicked), port), 
+	      false);
   return sw;
 }
 
@@ -439,6 +471,8 @@ Textbox* AZR3GUI::add_textbox(Fixed& fbox, RefPtr<Pixmap>& pm,
 
 
 bool AZR3GUI::change_mode(bool fx_mode, Fixed& fbox) {
+  if (!fx_mode && !m_voice_page_built)
+    build_voice_page();
   int x, y;
   if (fx_mode && !m_showing_fx_controls) {
     for (unsigned i = 0; i < m_voice_widgets.size(); ++i) {
@@ -465,22 +499,85 @@ bool AZR3GUI::change_mode(bool fx_mode, Fixed& fbox) {
 }
 
 
+void AZR3GUI::build_voice_page() {
+  
+  RefPtr<Pixmap> voicepxm = pixmap_from_file(DATADIR "/voice.png");
+  int w, h;
+  voicepxm->get_size(w, h);
+  m_vbox.set_size_request(w, h);
+  RefPtr<Style> s = m_vbox.get_style()->copy();
+  s->set_bg_pixmap(STATE_NORMAL, voicepxm);
+  s->set_bg_pixmap(STATE_ACTIVE, voicepxm);
+  s->set_bg_pixmap(STATE_PRELIGHT, voicepxm);
+  s->set_bg_pixmap(STATE_SELECTED, voicepxm);
+  s->set_bg_pixmap(STATE_INSENSITIVE, voicepxm);
+  m_vbox.set_style(s);
+  
+  // mode switcher 2
+  Widget* eb2 = add_clickbox(m_vbox, 14, 53, 14, 44);
+  eb2->signal_button_press_event().
+    connect(sigc::hide(sigc::bind(sigc::bind(mem_fun(*this, &AZR3GUI::change_mode), 
+				 std::ref(m_fbox)), true)));
+
+  // vibrato controls
+  add_switch(m_vbox, n_1_vibrato, 39, 17, Switch::Green);
+  add_knob(m_vbox, voicepxm, n_1_vstrength, 0, 1, 
+	   m_values[n_1_vstrength], 88, 37, 0, 100, false);
+  add_knob(m_vbox, voicepxm, n_1_vmix, 0, 1, 
+	   m_values[n_1_vmix], 176, 37, 0, 100, false);
+  add_switch(m_vbox, n_2_vibrato, 302, 17, Switch::Green);
+  add_knob(m_vbox, voicepxm, n_2_vstrength, 0, 1, 
+	   m_values[n_2_vstrength], 352, 37, 0, 100, false);
+  add_knob(m_vbox, voicepxm, n_2_vmix, 0, 1, 
+	   m_values[n_2_vmix], 440, 37, 0, 100, false);
+  m_adj[n_1_vibrato]->set_value(m_values[n_1_vibrato]);
+  m_adj[n_2_vibrato]->set_value(m_values[n_2_vibrato]);
+  
+  m_vbox.show_all();
+  m_voice_page_built = true;
+}
+
+
 void AZR3GUI::splitpoint_changed() {
   float value = m_adj[n_splitpoint]->get_value();
   int key = int(value * 128);
-  if (key <= 0 || key >= 128) {
-    m_tbox->set_string(2, "Keyboard split OFF");
+  show_splitpoint();
+  if (key <= 0 || key >= 128)
     m_splitswitch->get_adjustment().set_value(0);
-  }
   else {
     m_splitkey = key;
-    m_tbox->set_string(2, string("Splitpoint: ") + note2str(key));
     m_splitswitch->get_adjustment().set_value(1);
   }
   control_changed(n_splitpoint, value);
 }
 
 
+bool AZR3GUI::show_splitpoint() {
+  int key = int(m_adj[n_splitpoint]->get_value() * 128);
+  if (key <= 0 || key >= 128)
+    m_tbox->set_string(2, "Keyboard split OFF");
+  else
+    m_tbox->set_string(2, string("Splitpoint: ") + note2str(key));
+  return false;
+}
+
+
+void AZR3GUI::show_message(const string& text) {
+  m_message_timeout.disconnect();
+  m_tbox->set_string(2, text);
+  m_message_timeout = Glib::signal_timeout().
+    connect(mem_fun(*this, &AZR3GUI::show_splitpoint), 3000);
+}
+
+
+bool AZR3GUI::learn_clicked(GdkEventButton* event, uint32_t port) {
+  if (event->type != GDK_BUTTON_PRESS || event->button != 3)
+    return false;
+  signal_learn_control(port);
+  return true;
+}
+
+
 void AZR3GUI::update_program_menu() {
   m_program_menu->items().clear();
   std::map<int, string>::const_iterator iter;
@@ -22,6 +22,7 @@
 #ifndef AZR3_GTK_HPP
 #define AZR3_GTK_HPP
 
+#include <map>
 #include <stdint.h>
 #include <vector>
 
@@ -40,6 +41,9 @@ public:
   sigc::signal<void, uint32_t, float> signal_set_control;
   sigc::signal<void, unsigned char> signal_set_program;
   sigc::signal<void, unsigned char, std::string> signal_save_program;
+  /** Emitted when a control is clicked with the right mouse button, to
+      bind it to the next MIDI controller that moves. */
+  sigc::signal<void, uint32_t> signal_learn_control;
   
   AZR3GUI();
   
@@ -49,10 +53,27 @@ public:
   void set_program(unsigned char number);
   void clear_programs();
   
+  /** Show @c text on the last line of the display for a few seconds. */
+  void show_message(const std::string& text);
+  
+  /** Load an image file into a pixmap, and its transparency mask into
+      @c bitmap if it isn't 0. Every file is only decoded once, later calls
+      return the same pixmap and mask, so all widgets that use the same
+      image share them. */
   static Glib::RefPtr<Gdk::Pixmap> pixmap_from_file(const std::string& file, Glib::RefPtr<Gdk::Bitmap>* bitmap = 0);
   
+  /** Redraw @c widget at the next frame tick instead of right away. All
+      the changes that a widget gets between two ticks, for example from a
+      MIDI controller sweep, only cause one redraw. */
+  static void queue_redraw(Gtk::Widget* widget);
+  
+  /** Forget a widget that is being destroyed. */
+  static void cancel_redraw(Gtk::Widget* widget);
+  
 protected:
 
+  static bool redraw_tick();
+
   void control_changed(uint32_t index, float new_value);
   void program_changed(int program);
   
@@ -78,7 +99,14 @@ protected:
                        int xoffset, int yoffset, int lines, 
                        int width, int height);
   bool change_mode(bool fx_mode, Gtk::Fixed& fbox);
+  /** Create the widgets on the voice page. This isn't done until the page
+      is shown for the first time, to make the startup faster. */
+  void build_voice_page();
   void splitpoint_changed();
+  /** Show the split point on the last line of the display. Returns false
+      so it can be used as a timeout handler. */
+  bool show_splitpoint();
+  bool learn_clicked(GdkEventButton* event, uint32_t port);
   void update_program_menu();
   void update_split_menu();
   Gtk::Menu* create_menu();
@@ -88,6 +116,7 @@ protected:
 
 
   bool m_showing_fx_controls;
+  bool m_voice_page_built;
   std::vector<Widget*> m_fx_widgets;
   std::vector<Widget*> m_voice_widgets;
   std::map<int, std::string> m_programs;
@@ -98,11 +127,23 @@ protected:
   Gtk::Adjustment* m_splitpoint_adj;
   Gtk::Menu* m_program_menu;
   Gtk::Menu* m_split_menu;
+  sigc::connection m_message_timeout;
   Gdk::Color m_menu_bg;
   Gdk::Color m_menu_fg;
   Gtk::Fixed m_fbox;
   Gtk::Fixed m_vbox;
   std::vector<Gtk::Adjustment*> m_adj;
+  /** The values from set_control(), used for widgets that don't exist
+      yet. */
+  std::vector<float> m_values;
+  
+  static std::vector<Gtk::Widget*> pending_redraws;
+  
+  struct CachedPixmap {
+    Glib::RefPtr<Gdk::Pixmap> pixmap;
+    Glib::RefPtr<Gdk::Bitmap> bitmap;
+  };
+  static std::map<std::string, CachedPixmap> pixmap_cache;
 
 };
 
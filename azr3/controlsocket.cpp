@@ -0,0 +1,215 @@
+/****************************************************************************
+
+    controlsocket.cpp - A line based control protocol on a UNIX socket
+
+    Copyright (C) 2026 agent <agent@local>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as published
+    by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 01222-1307  USA
+
+****************************************************************************/
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "controlsocket.hpp"
+
+
+using namespace std;
+
+
+namespace {
+
+  // a client that sends this much without a newline is dropped
+  const size_t max_line = 4096;
+
+  // a client that has this much unread output is dropped
+  const size_t max_output = 65536;
+
+
+  /* Returns true if nothing accepts connections on the socket at @c addr
+     any more. The connection attempt doesn't block, a program that is too
+     busy to accept counts as running. */
+  bool is_stale(const sockaddr_un& addr) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+      return false;
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    bool stale =
+      (connect(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) &&
+       errno == ECONNREFUSED);
+    close(fd);
+    return stale;
+  }
+
+}
+
+
+ControlSocket::ControlSocket(const string& path)
+  : m_path(path),
+    m_fd(-1) {
+
+  sockaddr_un addr;
+  if (path.size() >= sizeof(addr.sun_path))
+    throw runtime_error("The socket path " + path + " is too long");
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path.c_str());
+
+  m_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (m_fd < 0)
+    throw runtime_error(string("Could not create a socket: ") +
+			strerror(errno));
+  fcntl(m_fd, F_SETFD, FD_CLOEXEC);
+
+  // only replace a stale socket, never a file or the socket of a program
+  // that is still running
+  struct stat st;
+  if (!lstat(path.c_str(), &st)) {
+    string msg;
+    if (!S_ISSOCK(st.st_mode))
+      msg = path + " exists and is not a socket";
+    else if (!is_stale(addr))
+      msg = "Another program is listening on " + path;
+    if (!msg.empty()) {
+      close(m_fd);
+      throw runtime_error(msg);
+    }
+    unlink(path.c_str());
+  }
+
+  if (bind(m_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) ||
+      listen(m_fd, 8)) {
+    string msg = string("Could not listen on ") + path + ": " +
+      strerror(errno);
+    close(m_fd);
+    throw runtime_error(msg);
+  }
+}
+
+
+ControlSocket::~ControlSocket() {
+  for (unsigned i = 0; i < m_clients.size(); ++i)
+    close(m_clients[i].fd);
+  close(m_fd);
+  unlink(m_path.c_str());
+}
+
+
+const string& ControlSocket::get_path() const {
+  return m_path;
+}
+
+
+void ControlSocket::add_pollfds(vector<pollfd>& fds) const {
+  pollfd pfd;
+  pfd.fd = m_fd;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+  fds.push_back(pfd);
+  for (unsigned i = 0; i < m_clients.size(); ++i) {
+    pfd.fd = m_clients[i].fd;
+    pfd.events = (m_clients[i].output.empty() ? POLLIN : POLLIN | POLLOUT);
+    fds.push_back(pfd);
+  }
+}
+
+
+void ControlSocket::handle(const vector<pollfd>& fds) {
+
+  // read from the clients first, new clients are appended to the list and
+  // haven't sent anything yet
+  for (unsigned i = 0; i < fds.size(); ++i) {
+    if (!fds[i].revents || fds[i].fd == m_fd)
+      continue;
+    for (unsigned c = 0; c < m_clients.size(); ++c) {
+      if (m_clients[c].fd != fds[i].fd)
+	continue;
+      bool ok = true;
+      if (fds[i].revents & POLLOUT)
+	ok = write_client(m_clients[c]);
+      if (ok && (fds[i].revents & ~POLLOUT))
+	ok = read_client(m_clients[c]);
+      if (!ok) {
+	close(m_clients[c].fd);
+	m_clients.erase(m_clients.begin() + c);
+      }
+      break;
+    }
+  }
+
+  for (unsigned i = 0; i < fds.size(); ++i) {
+    if (fds[i].fd == m_fd && (fds[i].revents & POLLIN)) {
+      int fd = accept(m_fd, 0, 0);
+      if (fd >= 0) {
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	Client client;
+	client.fd = fd;
+	m_clients.push_back(client);
+      }
+    }
+  }
+}
+
+
+bool ControlSocket::read_client(Client& client) {
+  char buf[512];
+  ssize_t n = read(client.fd, buf, sizeof(buf));
+  if (n < 0)
+    return errno == EINTR || errno == EAGAIN;
+  if (n == 0)
+    return false;
+  client.buffer.append(buf, n);
+
+  string::size_type end;
+  while ((end = client.buffer.find('\n')) != string::npos) {
+    string line = client.buffer.substr(0, end);
+    client.buffer.erase(0, end + 1);
+    if (!line.empty() && line[line.size() - 1] == '\r')
+      line.erase(line.size() - 1);
+    if (line.empty())
+      continue;
+    client.output += signal_command(line);
+  }
+
+  if (!write_client(client))
+    return false;
+  return client.buffer.size() < max_line && client.output.size() < max_output;
+}
+
+
+bool ControlSocket::write_client(Client& client) {
+  size_t done = 0;
+  while (done < client.output.size()) {
+    ssize_t n = send(client.fd, client.output.data() + done,
+		     client.output.size() - done, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR)
+	continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+	break;
+      return false;
+    }
+    done += n;
+  }
+  client.output.erase(0, done);
+  return true;
+}
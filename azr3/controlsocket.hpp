@@ -0,0 +1,90 @@
+/****************************************************************************
+
+    controlsocket.hpp - A line based control protocol on a UNIX socket
+
+    Copyright (C) 2026 agent <agent@local>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as published
+    by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 01222-1307  USA
+
+****************************************************************************/
+
+#ifndef CONTROLSOCKET_HPP
+#define CONTROLSOCKET_HPP
+
+#include <string>
+#include <vector>
+
+#include <poll.h>
+#include <sigc++/sigc++.h>
+
+
+/** A listening UNIX stream socket that any number of local clients can
+    connect to. Clients send commands as lines of text, and every line is
+    passed to signal_command. The string that the slot returns is written
+    back to the client that sent the command, the clients never block the
+    owner: replies that don't fit in the socket buffer are queued, and a
+    client that doesn't read them is dropped. The socket doesn't run a loop
+    of its own, the owner adds the file descriptors to its poll() set with
+    add_pollfds() and calls handle() with the result. */
+class ControlSocket {
+public:
+
+  /** Create the socket at @c path. A stale socket file from an earlier
+      process is replaced. Throws std::runtime_error if the socket can't
+      be created, if @c path is something else than a socket or if another
+      program is listening on it. */
+  ControlSocket(const std::string& path);
+
+  /** Close all connections and remove the socket file. */
+  ~ControlSocket();
+
+  const std::string& get_path() const;
+
+  /** Append the file descriptors that should be polled for input, and for
+      output if there are queued replies. */
+  void add_pollfds(std::vector<pollfd>& fds) const;
+
+  /** Accept new clients, read commands and write queued replies for the
+      file descriptors in @c fds that have events. */
+  void handle(const std::vector<pollfd>& fds);
+
+  /** Emitted for every command line (without the newline). The return
+      value is sent back to the client, it should end with a newline. */
+  sigc::signal<std::string, const std::string&> signal_command;
+
+protected:
+
+  struct Client {
+    int fd;
+    std::string buffer;
+    /** Replies that haven't been sent yet. */
+    std::string output;
+  };
+
+  /** Read from a client and handle all complete lines. Returns false if
+      the client has hung up or misbehaved and should be dropped. */
+  bool read_client(Client& client);
+
+  /** Send as much of the queued output as the socket takes without
+      blocking. Returns false if the client should be dropped. */
+  bool write_client(Client& client);
+
+  std::string m_path;
+  int m_fd;
+  std::vector<Client> m_clients;
+
+};
+
+
+#endif
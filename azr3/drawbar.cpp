@@ -34,10 +34,17 @@ using namespace std;
 Drawbar::Drawbar(float min, float max, float value, Type type) 
   : m_adj(value, min, max),
     m_type(type) {
+  m_shown_position = get_position();
   set_size_request(22, 150);
   add_events(EXPOSURE_MASK | BUTTON1_MOTION_MASK | 
              BUTTON_PRESS_MASK | SCROLL_MASK);
-  m_adj.signal_value_changed().connect(mem_fun(*this, &Drawbar::queue_draw));
+  m_adj.signal_value_changed().
+    connect(mem_fun(*this, &Drawbar::value_changed));
+}
+
+
+Drawbar::~Drawbar() {
+  AZR3GUI::cancel_redraw(this);
 }
  
  
@@ -59,23 +66,38 @@ void Drawbar::on_realize() {
   else if (m_type == Brown)
     filename = DATADIR "/dbbrown.png";
   m_pixmap = AZR3GUI::pixmap_from_file(filename);
+  m_gc = GC::create(get_window());
 }
 
 
 bool Drawbar::on_expose_event(GdkEventExpose* event) {
   RefPtr<Gdk::Window> win = get_window();
-  RefPtr<GC> gc = GC::create(win);
+  int position = get_position();
+  m_shown_position = position;
+  
+  // only copy the part of the drawbar that needs to be redrawn
+  GdkRectangle bar = { 0, 0, 22, 150 - (120 - position) };
+  GdkRectangle area;
+  if (gdk_rectangle_intersect(&event->area, &bar, &area))
+    win->draw_drawable(m_gc, m_pixmap, area.x, 120 - position + area.y, 
+		       area.x, area.y, area.width, area.height);
   
+  return true;
+}
+
+
+void Drawbar::value_changed() {
+  if (get_position() != m_shown_position)
+    AZR3GUI::queue_redraw(this);
+}
+
+
+int Drawbar::get_position() const {
   float value = (m_adj.get_value() - m_adj.get_lower()) / 
     (m_adj.get_upper() - m_adj.get_lower());
   value = value < 0 ? 0 : value;
   value = value > 1 ? 1 : value;
-  value = 120 * value;
-  
-  win->draw_drawable(gc, m_pixmap, 0, 120 - int(value), 0, 0, 
-                     22, 150 - (120 - int(value)));
-  
-  return true;
+  return int(120 * value);
 }
 
 
@@ -37,6 +37,8 @@ public:
   
   Drawbar(float min, float max, float value, Type type);
   
+  ~Drawbar();
+  
   void set_value(float value);
   
   Gtk::Adjustment& get_adjustment();
@@ -49,9 +51,17 @@ protected:
   bool on_button_press_event(GdkEventButton* event);
   bool on_scroll_event(GdkEventScroll* event);
   
+  /** Queue a redraw if the drawbar has moved at least one pixel. */
+  void value_changed();
+  
+  /** How many pixels the drawbar is pulled out. */
+  int get_position() const;
+  
   Gtk::Adjustment m_adj;
   Glib::RefPtr<Gdk::Pixmap> m_pixmap;
   Glib::RefPtr<Gdk::Bitmap> m_bitmap;
+  Glib::RefPtr<Gdk::GC> m_gc;
+  int m_shown_position;
   int m_click_offset;
   float m_value_offset;
   Type m_type;
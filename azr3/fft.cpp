@@ -0,0 +1,87 @@
+/****************************************************************************
+    
+    fft.cpp - A simple FFT used for generating band-limited wavetables
+    
+    Copyright (C) 2026 agent <agent@local>
+    
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as published
+    by the Free Software Foundation.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 01222-1307  USA
+
+****************************************************************************/
+
+#include <cmath>
+#include <vector>
+
+#include "fft.hpp"
+#include "globals.hpp"
+
+
+using namespace std;
+
+
+void fft(complex<double>* data, int n, bool inverse) {
+  
+  // bit reversal permutation
+  for (int i = 1, j = 0; i < n; ++i) {
+    int bit = n >> 1;
+    for ( ; j & bit; bit >>= 1)
+      j ^= bit;
+    j ^= bit;
+    if (i < j)
+      swap(data[i], data[j]);
+  }
+  
+  // butterflies
+  for (int len = 2; len <= n; len <<= 1) {
+    double angle = 2 * M_PI / len * (inverse ? 1 : -1);
+    complex<double> wlen(cos(angle), sin(angle));
+    for (int i = 0; i < n; i += len) {
+      complex<double> w(1);
+      for (int j = 0; j < len / 2; ++j) {
+	complex<double> u = data[i + j];
+	complex<double> v = data[i + j + len / 2] * w;
+	data[i + j] = u + v;
+	data[i + j + len / 2] = u - v;
+	w *= wlen;
+      }
+    }
+  }
+}
+
+
+void make_mip_levels(float* chain) {
+  
+  vector<complex<double> > spectrum(chain, chain + WAVETABLESIZE);
+  fft(&spectrum[0], WAVETABLESIZE, false);
+  
+  vector<complex<double> > level(WAVETABLESIZE);
+  float* t = chain;
+  
+  for (int size = WAVETABLESIZE; 
+       size >= (WAVETABLESIZE >> (WAVETABLEMIPS - 1)); size /= 2) {
+    
+    // keep everything that can be played at this level without aliasing
+    level.assign(size, 0);
+    level[0] = spectrum[0];
+    for (int k = 1; k < size / (2 * MIPOVERSAMPLING); ++k) {
+      level[k] = spectrum[k];
+      level[size - k] = spectrum[WAVETABLESIZE - k];
+    }
+    fft(&level[0], size, true);
+    
+    for (int i = 0; i < size; ++i)
+      t[i] = float(level[i].real() / WAVETABLESIZE);
+    t[size] = t[0];
+    t += size + 1;
+  }
+}
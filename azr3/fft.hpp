@@ -0,0 +1,43 @@
+/****************************************************************************
+    
+    fft.hpp - A simple FFT used for generating band-limited wavetables
+    
+    Copyright (C) 2026 agent <agent@local>
+    
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as published
+    by the Free Software Foundation.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 01222-1307  USA
+
+****************************************************************************/
+
+#ifndef FFT_HPP
+#define FFT_HPP
+
+#include <complex>
+
+
+/** In-place radix-2 FFT. @c n must be a power of two. If @c inverse is true
+    the inverse transform is computed, without the 1/n scaling. This is not
+    particularly fast and it is only meant to be used in the worker thread. */
+void fft(std::complex<double>* data, int n, bool inverse);
+
+/** Generate the mip levels for a wavetable. @c chain should point to a
+    buffer of MIPCHAINSIZE floats, where the first WAVETABLESIZE ones hold
+    one period of the waveform. That period is replaced by the first level
+    and each following level is half the size of the previous one. Every
+    level only contains the harmonics up to 1/MIPOVERSAMPLING of its
+    Nyquist frequency and is followed by a copy of its first sample, so
+    the voices can interpolate without wrapping. */
+void make_mip_levels(float* chain);
+
+
+#endif
@@ -0,0 +1,143 @@
+/****************************************************************************
+
+    filewriter.cpp - Writing files safely and in the background
+
+    Copyright (C) 2026 agent <agent@local>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as published
+    by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 01222-1307  USA
+
+****************************************************************************/
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#include <unistd.h>
+
+#include "filewriter.hpp"
+
+
+using namespace std;
+
+
+bool write_file_atomically(const string& file, const string& data,
+			   string& error) {
+
+  string tmp = file + ".XXXXXX";
+  vector<char> tmp_name(tmp.begin(), tmp.end());
+  tmp_name.push_back('\0');
+  int fd = mkstemp(&tmp_name[0]);
+  if (fd < 0) {
+    error = string("Could not create a temporary file: ") + strerror(errno);
+    return false;
+  }
+  size_t done = 0;
+  while (done < data.size()) {
+    ssize_t n = ::write(fd, data.data() + done, data.size() - done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      break;
+    done += n;
+  }
+  bool ok = (done == data.size() && !fsync(fd));
+  if (close(fd))
+    ok = false;
+  if (!ok || rename(&tmp_name[0], file.c_str())) {
+    error = strerror(errno);
+    unlink(&tmp_name[0]);
+    return false;
+  }
+
+  return true;
+}
+
+
+FileWriter::FileWriter()
+  : m_running(false),
+    m_quit(false) {
+  pthread_mutex_init(&m_mutex, 0);
+  sem_init(&m_sem, 0, 0);
+}
+
+
+FileWriter::~FileWriter() {
+  if (m_running) {
+    pthread_mutex_lock(&m_mutex);
+    m_quit = true;
+    pthread_mutex_unlock(&m_mutex);
+    sem_post(&m_sem);
+    pthread_join(m_thread, 0);
+  }
+  sem_destroy(&m_sem);
+  pthread_mutex_destroy(&m_mutex);
+}
+
+
+void FileWriter::write(const string& file, const string& data) {
+
+  pthread_mutex_lock(&m_mutex);
+  m_pending[file] = data;
+  pthread_mutex_unlock(&m_mutex);
+
+  // the thread is only started when it is needed
+  if (!m_running)
+    m_running = !pthread_create(&m_thread, 0,
+				&FileWriter::thread_function, this);
+  if (m_running)
+    sem_post(&m_sem);
+  else {
+    pthread_mutex_lock(&m_mutex);
+    m_pending.erase(file);
+    pthread_mutex_unlock(&m_mutex);
+    string error;
+    if (!write_file_atomically(file, data, error))
+      cerr<<"Could not write "<<file<<": "<<error<<endl;
+  }
+}
+
+
+void* FileWriter::thread_function(void* arg) {
+  static_cast<FileWriter*>(arg)->thread_function_real();
+  return 0;
+}
+
+
+void FileWriter::thread_function_real() {
+
+  while (true) {
+    while (sem_wait(&m_sem));
+
+    // only the newest data for each file is written, and it is written
+    // before the thread quits
+    pthread_mutex_lock(&m_mutex);
+    bool quit = m_quit;
+    map<string, string> pending;
+    pending.swap(m_pending);
+    pthread_mutex_unlock(&m_mutex);
+
+    map<string, string>::const_iterator iter;
+    for (iter = pending.begin(); iter != pending.end(); ++iter) {
+      string error;
+      if (!write_file_atomically(iter->first, iter->second, error))
+	cerr<<"Could not write "<<iter->first<<": "<<error<<endl;
+    }
+
+    if (quit)
+      break;
+  }
+}
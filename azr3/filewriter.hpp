@@ -0,0 +1,76 @@
+/****************************************************************************
+
+    filewriter.hpp - Writing files safely and in the background
+
+    Copyright (C) 2026 agent <agent@local>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as published
+    by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 01222-1307  USA
+
+****************************************************************************/
+
+#ifndef FILEWRITER_HPP
+#define FILEWRITER_HPP
+
+#include <map>
+#include <string>
+
+#include <pthread.h>
+#include <semaphore.h>
+
+
+/** Write @c data to @c file. The data goes to a temporary file in the same
+    directory first, which is synced and renamed when it is complete, so
+    @c file always has either the old or the new contents even if the
+    program crashes or the disk is full. Returns false and an error message
+    in @c error if the file could not be written. */
+bool write_file_atomically(const std::string& file, const std::string& data,
+			   std::string& error);
+
+
+/** A thread that writes files with write_file_atomically(), so the GUI
+    never waits for the disk. If a file is queued again while the thread is
+    still busy, only the newest data is written afterwards. The destructor
+    waits until everything that has been queued is written. */
+class FileWriter {
+public:
+
+  FileWriter();
+
+  ~FileWriter();
+
+  /** Queue @c data to be written to @c file. */
+  void write(const std::string& file, const std::string& data);
+
+protected:
+
+  static void* thread_function(void* arg);
+
+  void thread_function_real();
+
+  pthread_t m_thread;
+  bool m_running;
+
+  /** Protects the fields below. */
+  pthread_mutex_t m_mutex;
+  /** The newest data for every file that hasn't been written yet. */
+  std::map<std::string, std::string> m_pending;
+  bool m_quit;
+
+  /** Posted when there is something to write or the thread should quit. */
+  sem_t m_sem;
+
+};
+
+
+#endif
@@ -64,6 +64,9 @@ void delay::set_delay(float dtime)
   outPointer=writep-offset;
   if(outPointer<0)
     outPointer+=p_buflen;
+  // a tiny negative value can round up to p_buflen
+  if(outPointer>=p_buflen)
+    outPointer-=p_buflen;
         
   readp=(int)outPointer;
   alpha=outPointer-readp;
@@ -135,6 +138,162 @@ float delay::clock(float input)
   return(output);
 }
 
+/*
+  The multichannel delays work like delay, but all channels share one
+  interleaved buffer and write position. Only the read positions are
+  per channel, so the reads are gathered lane by lane and the rest is
+  done on whole vectors.
+*/
+stereo_delay::stereo_delay(int buflen)
+{
+  samplerate = 44100;
+  p_buflen=buflen;
+  buffer=new v2f[p_buflen];
+  flood(0);
+  readp[0]=readp[1]=0;
+  writep=p_buflen>>1;
+}
+
+stereo_delay::~stereo_delay()
+{
+  delete[] buffer;
+}
+
+void stereo_delay::set_delay(int lane, float dtime)
+{
+  float offset=dtime*samplerate*.001f;
+
+  if(offset<0.1f)
+    offset=0.1f;
+  else if(offset>=p_buflen)
+    offset=(float)p_buflen-1;
+
+  float outPointer=writep-offset;
+  if(outPointer<0)
+    outPointer+=p_buflen;
+  // a tiny negative value can round up to p_buflen
+  if(outPointer>=p_buflen)
+    outPointer-=p_buflen;
+  readp[lane]=(int)outPointer;
+}
+
+void stereo_delay::set_samplerate(float sr)
+{
+  samplerate=sr;
+}
+
+void stereo_delay::flood(float value)
+{
+  v2f v={value,value};
+  for(int x=0;x<p_buflen;x++)
+    buffer[x]=v;
+}
+
+v2f stereo_delay::clock(v2f input)
+{
+  buffer[writep]=input;
+  v2f output={buffer[readp[0]][0],buffer[readp[1]][1]};
+
+  if(++writep>=p_buflen)
+    writep=0;
+  for(int l=0;l<2;l++)
+    if(++readp[l]>=p_buflen)
+      readp[l]=0;
+
+  return(output);
+}
+
+quad_delay::quad_delay(int buflen)
+{
+  samplerate = 44100;
+  p_buflen=buflen;
+  buffer=new v4f[p_buflen];
+  flood(0);
+  v4f zero={0,0,0,0};
+  alpha=alpha2=alpha3=zero;
+  for(int l=0;l<4;l++)
+    readp[l]=0;
+  writep=p_buflen>>1;
+}
+
+quad_delay::~quad_delay()
+{
+  delete[] buffer;
+}
+
+void quad_delay::set_delay(int lane, float dtime)
+{
+  float offset=dtime*samplerate*.001f;
+
+  if(offset<0.1f)
+    offset=0.1f;
+  else if(offset>=p_buflen)
+    offset=(float)p_buflen-1;
+
+  float outPointer=writep-offset;
+  if(outPointer<0)
+    outPointer+=p_buflen;
+  // a tiny negative value can round up to p_buflen
+  if(outPointer>=p_buflen)
+    outPointer-=p_buflen;
+        
+  readp[lane]=(int)outPointer;
+  float a=outPointer-readp[lane];
+  alpha[lane]=a;
+  alpha2[lane]=a*a;
+  alpha3[lane]=a*a*a;
+}
+
+void quad_delay::set_samplerate(float sr)
+{
+  samplerate=sr;
+}
+
+void quad_delay::flood(float value)
+{
+  v4f v={value,value,value,value};
+  for(int x=0;x<p_buflen;x++)
+    buffer[x]=v;
+}
+
+v4f quad_delay::clock(v4f input)
+{
+  v4f ym1,y0,y1,y2;
+  int l;
+
+  buffer[writep]=input;
+
+  for(l=0;l<4;l++)
+    {
+      int p=readp[l];
+      int ym1p=p-1;
+      if(ym1p<0)
+	ym1p+=p_buflen;
+      int y1p=p+1;
+      if(y1p>=p_buflen)
+	y1p-=p_buflen;
+      int y2p=p+2;
+      if(y2p>=p_buflen)
+	y2p-=p_buflen;
+      ym1[l]=buffer[ym1p][l];
+      y0[l]=buffer[p][l];
+      y1[l]=buffer[y1p][l];
+      y2[l]=buffer[y2p][l];
+    }
+
+  v4f output=(alpha3*(y0-y1+y2-ym1)+
+	      alpha2*(-2*y0+y1-y2+2*ym1)+
+	      alpha*(y1-ym1)+y0);
+
+  if(++writep>=p_buflen)
+    writep=0;
+  for(l=0;l<4;l++)
+    if(++readp[l]>=p_buflen)
+      readp[l]=0;
+
+  return(output);
+}
+
 lfo::lfo(float sr)
 {
   // XXX make this initialise itself properly
@@ -157,11 +316,13 @@ void lfo::set_rate(float srate,int type)
   my_srate=srate;
   my_type=type;
   if(type==0)
-    inc=2.0f*PI*srate/samplerate;
+    {
+      inc=2.0f*PI*srate/samplerate;
+      ci=cosf(inc);
+      si=sinf(inc);
+    }
   else
     inc=2*srate/samplerate;
-  ci=cosf(inc);
-  si=sinf(inc);
 }
 
 float lfo::get_rate()
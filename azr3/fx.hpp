@@ -28,6 +28,14 @@
 #define DENORMALIZE(fv) (fv<.00000001f && fv>-.00000001f)?0:(fv)
 #define	PI	3.14159265358979323846f
 
+/*
+  Two and four floats that are processed as the lanes of one SIMD vector.
+  The rotary speaker uses them to run the left and right channels (and
+  some more paths) in parallel, see AZR3::process().
+*/
+typedef float v2f __attribute__((vector_size(8)));
+typedef float v4f __attribute__((vector_size(16)));
+
 class delay		// non-interpolating delay
 {
 public:
@@ -54,6 +62,71 @@ protected:
 	float	y2;
 };
 
+class stereo_delay	// non-interpolating delay with two channels
+{
+public:
+	stereo_delay(int buflen);
+	~stereo_delay();
+	void	set_delay(int lane, float dtime);
+	void	set_samplerate(float samplerate);
+	void	flood(float value);
+	v2f		clock(v2f input);
+protected:
+	v2f		*buffer;
+	int		p_buflen;
+	float	samplerate;
+	int		readp[2],writep;
+};
+
+class quad_delay	// interpolating delay with four channels
+{
+public:
+	quad_delay(int buflen);
+	~quad_delay();
+	void	set_delay(int lane, float dtime);
+	void	set_samplerate(float samplerate);
+	void	flood(float value);
+	v4f		clock(v4f input);
+protected:
+	v4f		*buffer;
+	int		p_buflen;
+	float	samplerate;
+	int		readp[4],writep;
+	v4f		alpha,alpha2,alpha3;
+};
+
+class stereo_allpass	// two of filt_allpass
+{
+public:
+	stereo_allpass()
+	{
+		v2f zero={0,0};
+		a1=zm1=zero;
+	}
+	void	reset()
+	{
+		v2f zero={0,0};
+		zm1=zero;
+	}
+	void	set_delay(float delay_r, float delay_l)
+	{
+		v2f d={delay_r,delay_l};
+		a1=(1-d)/(1+d);
+	}
+	v2f		clock(v2f input)
+	{
+		// a lane with a tiny input keeps its state and returns 0, like
+		// filt_allpass
+		v2f y=-a1*input+zm1;
+		v2f z=y*a1+input;
+		v2f zero={0,0};
+		zm1=(input<.00000001f && input>-.00000001f)?zm1:z;
+		return (input<.00000001f && input>-.00000001f)?zero:y;
+	}
+private:
+	v2f		a1,zm1;
+};
+
 class lfo
 {
 public:
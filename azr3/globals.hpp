@@ -27,7 +27,39 @@
 
 #define	VERSION	"1.3"
 
-#define	WAVETABLESIZE	200
+/*
+	The size of the largest wavetables. This must be a power of two.
+	Every wavetable also has WAVETABLEMIPS-1 band-limited versions at
+	half the size of the previous one, so the smallest one has
+	WAVETABLESIZE >> (WAVETABLEMIPS - 1) samples. The voices choose
+	the largest one that they can play without aliasing.
+*/
+#ifndef	WAVETABLESIZE
+#define	WAVETABLESIZE	2048
+#endif
+#ifndef	WAVETABLEMIPS
+#define	WAVETABLEMIPS	9
+#endif
+
+// the mip levels only contain harmonics up to 1/MIPOVERSAMPLING of their
+// Nyquist frequency, to keep the linear interpolation in the voices clean
+#ifndef	MIPOVERSAMPLING
+#define	MIPOVERSAMPLING	4
+#endif
+
+/*
+	If this is 1 the voices use a 32 bit fixed point phase accumulator
+	that wraps around by itself and never loses precision, otherwise a
+	floating point phase that is wrapped explicitly.
+*/
+#ifndef	FIXEDPHASE
+#define	FIXEDPHASE	1
+#endif
+
+// number of floats needed for a wavetable with all its mip levels,
+// including a guard sample after each level for the interpolation
+#define	MIPCHAINSIZE	(2 * WAVETABLESIZE - \
+			 (WAVETABLESIZE >> (WAVETABLEMIPS - 1)) + WAVETABLEMIPS)
 
 const float Pi = 3.14159265358979323f;
 
@@ -182,5 +214,17 @@ enum
 	n_mute
 };
 
+/*
+	The symbols of the controls, the same as in the LV2 plugin. The
+	preset files and the MIDI maps use them to name the controls.
+*/
+extern const char* const control_symbols[kNumParams];
+
+/*
+	The values that the controls start with, and that the presets have
+	for the controls they don't set.
+*/
+extern const float default_values[kNumParams];
+
 
 #endif
@@ -40,11 +40,18 @@ Knob::Knob(float min, float max, float value,
   
   if (m_dmax >= 1000)
     m_decimal = false;
+  m_shown_frame = get_frame();
+  m_shown_value = get_display_value();
   
   set_size_request(44, 44);
   add_events(EXPOSURE_MASK | BUTTON1_MOTION_MASK | 
              BUTTON_PRESS_MASK | SCROLL_MASK);
-  m_adj.signal_value_changed().connect(mem_fun(*this, &Knob::queue_draw));
+  m_adj.signal_value_changed().connect(mem_fun(*this, &Knob::value_changed));
+}
+
+
+Knob::~Knob() {
+  AZR3GUI::cancel_redraw(this);
 }
  
  
@@ -60,32 +67,55 @@ Gtk::Adjustment& Knob::get_adjustment() {
 
 void Knob::on_realize() {
   DrawingArea::on_realize();
-  char bits[(44 * 1804 + 1) / 8];
-  memset(bits, 0, (44 * 1804 + 1) / 8);
-  m_bitmap = Bitmap::create(bits, 44, 1804);
-  m_digbit = Bitmap::create(bits, 5, 84);
   m_pixmap = AZR3GUI::pixmap_from_file(DATADIR "/cknob.png", &m_bitmap);
   m_digpix = AZR3GUI::pixmap_from_file(DATADIR "/num_yellow.png", &m_digbit);
+  m_gc = GC::create(get_window());
 }
 
 
 bool Knob::on_expose_event(GdkEventExpose* event) {
   RefPtr<Gdk::Window> win = get_window();
-  RefPtr<GC> gc = GC::create(win);
+  int frame = get_frame();
+  m_shown_frame = frame;
+  m_shown_value = get_display_value();
+  
+  // only copy the part of the knob that needs to be redrawn
+  GdkRectangle knob = { 0, 0, 44, 44 };
+  GdkRectangle area;
+  if (gdk_rectangle_intersect(&event->area, &knob, &area)) {
+    m_gc->set_clip_mask(m_bitmap);
+    m_gc->set_clip_origin(0, -44 * frame);
+    win->draw_drawable(m_gc, m_pixmap, area.x, 44 * frame + area.y, 
+		       area.x, area.y, area.width, area.height);
+  }
+  
+  GdkRectangle digits = { 0, 18, 44, 8 };
+  if (gdk_rectangle_intersect(&event->area, &digits, &area))
+    draw_digits(win, m_gc);
   
+  return true;
+}
+
+
+void Knob::value_changed() {
+  if (get_frame() != m_shown_frame || get_display_value() != m_shown_value)
+    AZR3GUI::queue_redraw(this);
+}
+
+
+int Knob::get_frame() const {
   float value = (m_adj.get_value() - m_adj.get_lower()) / 
     (m_adj.get_upper() - m_adj.get_lower());
   value = value < 0 ? 0 : value;
   value = value > 1 ? 1 : value;
-  value = 40 * value;
-  
-  gc->set_clip_mask(m_bitmap);
-  gc->set_clip_origin(0, -44 * int(value));
-  win->draw_drawable(gc, m_pixmap, 0, 44 * int(value), 0, 0, 44, 44);
-  
-  draw_digits(win, gc);
-  
-  return true;
+  return int(40 * value);
+}
+
+
+int Knob::get_display_value() const {
+  float dvalue = (m_adj.get_value() - m_adj.get_lower()) / 
+    (m_adj.get_upper() - m_adj.get_lower());
+  return int((dvalue * (m_dmax - m_dmin) + m_dmin) * 10);
 }
 
 
@@ -32,6 +32,8 @@ public:
   Knob(float min, float max, float value, 
        float dmin, float dmax, bool decimal);
   
+  ~Knob();
+  
   void set_value(float value);
   
   Gtk::Adjustment& get_adjustment();
@@ -44,6 +46,16 @@ protected:
   bool on_button_press_event(GdkEventButton* event);
   bool on_scroll_event(GdkEventScroll* event);
   
+  /** Queue a redraw if the value has changed enough to change the
+      picture. */
+  void value_changed();
+  
+  /** Which of the 41 frames in the knob image that shows the value. */
+  int get_frame() const;
+  
+  /** The number shown in the display, times 10. */
+  int get_display_value() const;
+  
   void draw_digits(Glib::RefPtr<Gdk::Window>& win, Glib::RefPtr<Gdk::GC>& gc);
   void draw_digit(Glib::RefPtr<Gdk::Window>& win, Glib::RefPtr<Gdk::GC>& gc,
                   int xoffset, int digit);
@@ -53,11 +65,14 @@ protected:
   Glib::RefPtr<Gdk::Bitmap> m_bitmap;
   Glib::RefPtr<Gdk::Pixmap> m_digpix;
   Glib::RefPtr<Gdk::Bitmap> m_digbit;
+  Glib::RefPtr<Gdk::GC> m_gc;
   int m_click_offset;
   float m_value_offset;
   float m_dmin;
   float m_dmax;
   bool m_decimal;
+  int m_shown_frame;
+  int m_shown_value;
 };
 
 
@@ -0,0 +1,342 @@
+/****************************************************************************
+
+    azr3_lv2.cpp - The LV2 plugin frontend for the AZR-3 engine
+
+    Copyright (C) 2026 agent <agent@local>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as published
+    by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 01222-1307  USA
+
+****************************************************************************/
+
+#include <cstring>
+
+#include <lv2/lv2plug.in/ns/lv2core/lv2.h>
+#include <lv2/lv2plug.in/ns/ext/atom/atom.h>
+#include <lv2/lv2plug.in/ns/ext/atom/util.h>
+#include <lv2/lv2plug.in/ns/ext/midi/midi.h>
+#include <lv2/lv2plug.in/ns/ext/state/state.h>
+#include <lv2/lv2plug.in/ns/ext/urid/urid.h>
+#include <lv2/lv2plug.in/ns/ext/worker/worker.h>
+
+#include "azr3.hpp"
+
+
+#define AZR3_URI "http://ll-plugins.nongnu.org/lv2/azr3"
+
+
+namespace {
+
+
+  /** The plugin instance. The engine reads its controls from a private
+      array instead of the host's control ports, since it writes to them
+      when it receives MIDI CCs. A host port value is only copied to the
+      array when it changes, so CCs and restored state stick until the
+      host moves the control. */
+  class AZR3LV2 {
+  public:
+
+    AZR3LV2(double rate, const LV2_Feature* const* features);
+
+    bool is_ok() const { return m_ok; }
+
+    void connect_port(uint32_t port, void* buffer);
+
+    void activate();
+
+    void run(uint32_t nframes);
+
+    void deactivate();
+
+    void work();
+
+    void save(LV2_State_Store_Function store, LV2_State_Handle handle);
+
+    void restore(LV2_State_Retrieve_Function retrieve,
+		 LV2_State_Handle handle);
+
+  private:
+
+    static void schedule(void* data);
+
+    AZR3 m_engine;
+    bool m_ok;
+
+    float m_controls[kNumParams];
+    float m_last_port[kNumParams];
+    const float* m_control_ports[kNumParams];
+    const LV2_Atom_Sequence* m_midi_port;
+    float* m_audio_ports[kNumPorts - port_left];
+
+    /** The MIDI events of the current cycle. */
+    MidiEvent m_events[1024];
+
+    LV2_Worker_Schedule* m_schedule;
+
+    LV2_URID m_midi_event;
+    LV2_URID m_atom_vector;
+    LV2_URID m_atom_float;
+    LV2_URID m_controls_key;
+
+  };
+
+
+  /** The controls as they are saved in the plugin state, an atom:Vector of
+      atom:Float. */
+  struct ControlState {
+    LV2_Atom_Vector_Body body;
+    float values[kNumParams];
+  };
+
+
+  AZR3LV2::AZR3LV2(double rate, const LV2_Feature* const* features)
+    : m_engine(rate),
+      m_ok(false),
+      m_midi_port(0),
+      m_schedule(0) {
+
+    LV2_URID_Map* map = 0;
+    for (int i = 0; features[i]; ++i) {
+      if (!strcmp(features[i]->URI, LV2_URID__map))
+	map = static_cast<LV2_URID_Map*>(features[i]->data);
+      else if (!strcmp(features[i]->URI, LV2_WORKER__schedule))
+	m_schedule = static_cast<LV2_Worker_Schedule*>(features[i]->data);
+    }
+    if (!map)
+      return;
+    m_midi_event = map->map(map->handle, LV2_MIDI__MidiEvent);
+    m_atom_vector = map->map(map->handle, LV2_ATOM__Vector);
+    m_atom_float = map->map(map->handle, LV2_ATOM__Float);
+    m_controls_key = map->map(map->handle, AZR3_URI "#controls");
+
+    for (int i = 0; i < kNumParams; ++i) {
+      m_controls[i] = 0;
+      m_last_port[i] = -1;
+      m_control_ports[i] = 0;
+      m_engine.connect_port(i, &m_controls[i]);
+    }
+    for (int i = 0; i < kNumPorts - port_left; ++i)
+      m_audio_ports[i] = 0;
+
+    // without the worker extension the engine starts a thread of its own
+    if (m_schedule)
+      m_engine.set_worker_callback(&AZR3LV2::schedule, this);
+
+    m_ok = true;
+  }
+
+
+  void AZR3LV2::connect_port(uint32_t port, void* buffer) {
+    if (port < kNumParams)
+      m_control_ports[port] = static_cast<const float*>(buffer);
+    else if (port == port_midi)
+      m_midi_port = static_cast<const LV2_Atom_Sequence*>(buffer);
+    else if (port < kNumPorts)
+      m_audio_ports[port - port_left] = static_cast<float*>(buffer);
+  }
+
+
+  void AZR3LV2::activate() {
+    m_engine.activate();
+  }
+
+
+  void AZR3LV2::run(uint32_t nframes) {
+
+    // pick up the controls that the host has changed
+    for (int i = 0; i < kNumParams; ++i) {
+      if (*m_control_ports[i] != m_last_port[i]) {
+	m_last_port[i] = *m_control_ports[i];
+	m_controls[i] = m_last_port[i];
+      }
+    }
+
+    ProcessContext ctx;
+    ctx.nframes = nframes;
+
+    // the events point into the atom sequence, only the headers are copied
+    uint32_t n = 0;
+    LV2_ATOM_SEQUENCE_FOREACH(m_midi_port, ev) {
+      if (n == sizeof(m_events) / sizeof(m_events[0]))
+	break;
+      if (ev->body.type != m_midi_event || ev->time.frames < 0 ||
+	  ev->time.frames >= nframes)
+	continue;
+      m_events[n].time = ev->time.frames;
+      m_events[n].size = ev->body.size;
+      m_events[n].data = reinterpret_cast<const unsigned char*>(ev + 1);
+      ++n;
+    }
+    ctx.events = m_events;
+    ctx.event_count = n;
+
+    ctx.output[0] = m_audio_ports[port_left - port_left];
+    ctx.output[1] = m_audio_ports[port_right - port_left];
+    ctx.input[0] = m_audio_ports[port_in_left - port_left];
+    ctx.input[1] = m_audio_ports[port_in_right - port_left];
+    ctx.dry[0] = m_audio_ports[port_upper - port_left];
+    ctx.dry[1] = m_audio_ports[port_lower - port_left];
+    ctx.dry[2] = m_audio_ports[port_pedal - port_left];
+    ctx.prespeaker = m_audio_ports[port_prespeaker - port_left];
+    ctx.speaker[0] = m_audio_ports[port_speaker_left - port_left];
+    ctx.speaker[1] = m_audio_ports[port_speaker_right - port_left];
+
+    m_engine.process(ctx);
+  }
+
+
+  void AZR3LV2::deactivate() {
+    m_engine.deactivate();
+  }
+
+
+  void AZR3LV2::work() {
+    m_engine.do_work();
+  }
+
+
+  void AZR3LV2::save(LV2_State_Store_Function store,
+		     LV2_State_Handle handle) {
+    ControlState state;
+    state.body.child_size = sizeof(float);
+    state.body.child_type = m_atom_float;
+    memcpy(state.values, m_controls, sizeof(state.values));
+    store(handle, m_controls_key, &state, sizeof(state), m_atom_vector,
+	  LV2_STATE_IS_POD | LV2_STATE_IS_PORTABLE);
+  }
+
+
+  void AZR3LV2::restore(LV2_State_Retrieve_Function retrieve,
+			LV2_State_Handle handle) {
+    size_t size;
+    uint32_t type;
+    uint32_t flags;
+    const void* value = retrieve(handle, m_controls_key, &size, &type, &flags);
+    if (!value || type != m_atom_vector || size != sizeof(ControlState))
+      return;
+    const ControlState* state = static_cast<const ControlState*>(value);
+    if (state->body.child_type != m_atom_float ||
+	state->body.child_size != sizeof(float))
+      return;
+
+    // the host has already restored its control ports, don't let the next
+    // run() overwrite the values from the state with them
+    for (int i = 0; i < kNumParams; ++i) {
+      m_controls[i] = state->values[i];
+      if (m_control_ports[i])
+	m_last_port[i] = *m_control_ports[i];
+    }
+  }
+
+
+  void AZR3LV2::schedule(void* data) {
+    AZR3LV2* me = static_cast<AZR3LV2*>(data);
+    me->m_schedule->schedule_work(me->m_schedule->handle, 0, 0);
+  }
+
+
+  // the C callbacks
+
+  LV2_Handle instantiate(const LV2_Descriptor*, double rate, const char*,
+			 const LV2_Feature* const* features) {
+    AZR3LV2* me = new AZR3LV2(rate, features);
+    if (!me->is_ok()) {
+      delete me;
+      return 0;
+    }
+    return me;
+  }
+
+
+  void connect_port(LV2_Handle instance, uint32_t port, void* buffer) {
+    static_cast<AZR3LV2*>(instance)->connect_port(port, buffer);
+  }
+
+
+  void activate(LV2_Handle instance) {
+    static_cast<AZR3LV2*>(instance)->activate();
+  }
+
+
+  void run(LV2_Handle instance, uint32_t nframes) {
+    static_cast<AZR3LV2*>(instance)->run(nframes);
+  }
+
+
+  void deactivate(LV2_Handle instance) {
+    static_cast<AZR3LV2*>(instance)->deactivate();
+  }
+
+
+  void cleanup(LV2_Handle instance) {
+    delete static_cast<AZR3LV2*>(instance);
+  }
+
+
+  LV2_Worker_Status work(LV2_Handle instance, LV2_Worker_Respond_Function,
+			 LV2_Worker_Respond_Handle, uint32_t, const void*) {
+    static_cast<AZR3LV2*>(instance)->work();
+    return LV2_WORKER_SUCCESS;
+  }
+
+
+  LV2_Worker_Status work_response(LV2_Handle, uint32_t, const void*) {
+    return LV2_WORKER_SUCCESS;
+  }
+
+
+  LV2_State_Status save(LV2_Handle instance, LV2_State_Store_Function store,
+			LV2_State_Handle handle, uint32_t,
+			const LV2_Feature* const*) {
+    static_cast<AZR3LV2*>(instance)->save(store, handle);
+    return LV2_STATE_SUCCESS;
+  }
+
+
+  LV2_State_Status restore(LV2_Handle instance,
+			   LV2_State_Retrieve_Function retrieve,
+			   LV2_State_Handle handle, uint32_t,
+			   const LV2_Feature* const*) {
+    static_cast<AZR3LV2*>(instance)->restore(retrieve, handle);
+    return LV2_STATE_SUCCESS;
+  }
+
+
+  const void* extension_data(const char* uri) {
+    static const LV2_Worker_Interface worker = { work, work_response, 0 };
+    static const LV2_State_Interface state = { save, restore };
+    if (!strcmp(uri, LV2_WORKER__interface))
+      return &worker;
+    if (!strcmp(uri, LV2_STATE__interface))
+      return &state;
+    return 0;
+  }
+
+
+  const LV2_Descriptor descriptor = {
+    AZR3_URI,
+    instantiate,
+    connect_port,
+    activate,
+    run,
+    deactivate,
+    cleanup,
+    extension_data
+  };
+
+}
+
+
+LV2_SYMBOL_EXPORT const LV2_Descriptor* lv2_descriptor(uint32_t index) {
+  return index == 0 ? &descriptor : 0;
+}
@@ -19,19 +19,37 @@
 
 ****************************************************************************/
 
+#include <cerrno>
+#include <csignal>
 #include <cstdlib>
 #include <cstring>
 #include <fstream>
 #include <iostream>
+#include <sstream>
 #include <stdexcept>
 
+#include <jack/midiport.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <unistd.h>
+
 #include "main.hpp"
 #include "optionparser.hpp"
 
 using namespace std;
 
 
-Main::Main(int& argc, char**& argv) : m_ok(false) {
+Main::Main(int& argc, char**& argv) 
+  : m_gui(0),
+    m_ok(false),
+    m_exit_status(0),
+    m_kit(0),
+    m_win(0),
+    m_headless(false),
+    m_quit(false),
+    m_socket(0),
+    m_wake_fd(-1),
+    m_xruns(0) {
   
   /* this is a bit dumb, but the only way I know of to check whether we were
      started by lashd is to see if lash_extract_args() removes any arguments */
@@ -45,6 +63,12 @@ Main::Main(int& argc, char**& argv) : m_ok(false) {
   bool version(false);
   unsigned preset_no(128);
   string jack_name("AZR-3");
+  string rotor_name("classic");
+  bool effect_only(false);
+  bool multi_output(false);
+  string socket_path;
+  string midi_map_file;
+  bool timing_test(false);
   try {
     op.set_env_prefix("AZR3_JACK_")
       .add_bare("help", "h", help, 
@@ -61,6 +85,22 @@ Main::Main(int& argc, char**& argv) : m_ok(false) {
 	   "output ports to PORT (if it's a JACK port name) or\n"
 	   "the first two audio input ports in CLIENT (if it's\n"
 	   "a JACK client name).")
+      .add("audio-input", "i", "PORT|CLIENT", m_auto_input,
+	   "When used, azr3 will try to connect its audio\n"
+	   "input ports to PORT (if it's a JACK port name) or\n"
+	   "the first two audio output ports in CLIENT (if it's\n"
+	   "a JACK client name).")
+      .add_bare("effect-only", "e", effect_only,
+		"Don't play any notes, only run the audio input\n"
+		"through the distortion and the rotary speaker.")
+      .add_bare("multi-output", "o", multi_output,
+		"Add dry outputs for each manual, a mono output\n"
+		"before the rotary speaker and stereo outputs with\n"
+		"only the rotary speaker.")
+      .add("midi-map", "c", "FILE", midi_map_file,
+	   "Read the MIDI controller bindings from FILE\n"
+	   "instead of ~/.azr3_jack_midimap. Bindings that\n"
+	   "are learned in the GUI are saved there.")
       .add("preset", "p", "NUMBER", preset_no,
 	   "Load the preset with the given number instead of\n"
 	   "the first available one.")
@@ -68,6 +108,23 @@ Main::Main(int& argc, char**& argv) : m_ok(false) {
 	   "Set the name of the JACK client. The default is\n"
 	   "'AZR-3'. Note that JACK may change this name by\n"
 	   "e.g. adding a number at the end if needed.")
+      .add("rotor", "r", "QUALITY", rotor_name,
+	   "Choose the rotary speaker engine. 'classic' is the\n"
+	   "original AZR-3 Leslie (the default). 'eco', 'standard'\n"
+	   "and 'high' are the modelled rotary speaker in three\n"
+	   "qualities, 'eco' uses the least CPU.")
+      .add_bare("headless", "n", m_headless,
+		"Run without a GUI. The organ is controlled with\n"
+		"MIDI and through the control socket.")
+      .add("control-socket", "s", "PATH", socket_path,
+	   "The UNIX socket that accepts commands in headless\n"
+	   "mode. The default is azr3-NAME.socket in\n"
+	   "$XDG_RUNTIME_DIR, where NAME is the JACK client\n"
+	   "name.")
+      .add_bare("timing-test", "t", timing_test,
+		"Render some notes without JACK, once in one cycle\n"
+		"and once for each of a few buffer sizes, check\n"
+		"that they start at the same frame and exit.")
       .parse_env()
       .parse(argc, argv);
   }
@@ -88,22 +145,22 @@ Main::Main(int& argc, char**& argv) : m_ok(false) {
     cout<<flush;
     return;
   }
+  
+  if (timing_test) {
+    m_exit_status = (run_timing_test(cout) ? 0 : 1);
+    return;
+  }
+  
+  int rotor_quality = rotary::parse_quality(rotor_name);
+  if (rotor_quality < 0) {
+    cerr<<"Unknown rotary speaker quality '"<<rotor_name<<"'"<<endl;
+    return;
+  }
     
   // initialise controls with default values
-  float defaults[] = { 0.00, 0.20, 0.20, 0.00, 0.00, 0.75, 0.50, 0.60, 0.60, 
-		       0.00, 0.22, 0.00, 1.00, 1.00, 0.00, 0.00, 0.00, 0.00,
-		       0.00, 0.00, 0.00, 0.00, 0.30, 0.35, 0.00, 0.00, 0.00,
-		       0.00, 0.00, 0.00, 0.00, 0.00, 0.00, 0.00, 0.00, 0.00,
-		       0.00, 0.00, 0.00, 0.00, 0.00, 0.00, 0.00, 0.00, 0.40,
-		       0.00, 0.66, 0.00, 1.00, 0.00, 0.10, 0.65, 0.05, 0.78,
-		       0.50, 0.50, 0.00, 0.00, 0.00, 0.00, 0.00, 0.00, 0.00 };
-  memcpy(m_controls, defaults, 63 * sizeof(float));
-  memcpy(m_gui_controls, defaults, 63 * sizeof(float));
-  for (int i = 0; i < 128; ++i)
-    memcpy(m_presets[i].values, defaults, 63 * sizeof(float));
-  pthread_mutex_init(&m_engine_wlock, 0);
+  memcpy(m_controls, default_values, 63 * sizeof(float));
+  memcpy(m_gui_controls, default_values, 63 * sizeof(float));
   pthread_mutex_init(&m_gui_wlock, 0);
-  sem_init(&m_engine_changed, 0, 0);
   sem_init(&m_program_changed, 0, 0);
   sem_init(&m_gui_changed, 0, 0);
     
@@ -114,6 +171,34 @@ Main::Main(int& argc, char**& argv) : m_ok(false) {
     snprintf(buf, 512, "%s/.azr3_jack_presets", getenv("HOME"));
     load_presets(buf);
   }
+  
+  // load the MIDI map, a broken map that was asked for is an error
+  if (!midi_map_file.empty()) {
+    if (!load_midi_map(midi_map_file))
+      return;
+    m_midi_map_file = midi_map_file;
+  }
+  else if (getenv("HOME")) {
+    m_midi_map_file = string(getenv("HOME")) + "/.azr3_jack_midimap";
+    load_midi_map(m_midi_map_file);
+  }
+    
+  /* in headless mode SIGINT and SIGTERM are read from a signalfd in the
+     main loop, so they have to be blocked before JACK starts its threads */
+  if (m_headless) {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, 0);
+  }
+  
+  // the JACK thread uses this to wake up the main loop
+  m_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (m_wake_fd < 0) {
+    cerr<<"Could not create an eventfd: "<<strerror(errno)<<endl;
+    return;
+  }
     
   // initialise JACK client
   m_jack_client = jack_client_open(jack_name.c_str(), jack_options_t(0), 0);
@@ -126,118 +211,409 @@ Main::Main(int& argc, char**& argv) : m_ok(false) {
   m_right_port = jack_port_register(m_jack_client, "Right", 
 				    JACK_DEFAULT_AUDIO_TYPE,
 				    JackPortIsOutput, 0);
-  if (!(m_jack_client && m_midi_port && m_left_port && m_right_port)) {
+  m_in_left_port = jack_port_register(m_jack_client, "Input Left", 
+				      JACK_DEFAULT_AUDIO_TYPE,
+				      JackPortIsInput, 0);
+  m_in_right_port = jack_port_register(m_jack_client, "Input Right", 
+				       JACK_DEFAULT_AUDIO_TYPE,
+				       JackPortIsInput, 0);
+  if (!(m_jack_client && m_midi_port && m_left_port && m_right_port &&
+	m_in_left_port && m_in_right_port)) {
     cerr<<"Could not initialise JACK client!"<<endl;
     return;
   }
+  const char* extra_names[] = { "Upper Dry", "Lower Dry", "Pedal Dry",
+				"Pre-Speaker", "Speaker Left", 
+				"Speaker Right" };
+  for (int i = 0; i <= port_speaker_right - port_upper; ++i) {
+    m_extra_ports[i] = 0;
+    if (multi_output) {
+      m_extra_ports[i] = jack_port_register(m_jack_client, extra_names[i],
+					    JACK_DEFAULT_AUDIO_TYPE,
+					    JackPortIsOutput, 0);
+      if (!m_extra_ports[i]) {
+	cerr<<"Could not register the port '"<<extra_names[i]<<"'!"<<endl;
+	return;
+      }
+    }
+  }
   jack_set_process_callback(m_jack_client, &Main::static_process, this);
+  jack_set_xrun_callback(m_jack_client, &Main::static_xrun, this);
     
   // create the engine and connect the controls
   m_engine = new AZR3(jack_get_sample_rate(m_jack_client));
+  m_engine->set_rotor_quality(rotor_quality);
+  m_engine->set_effect_only(effect_only);
   for (uint32_t i = 0; i < 63; ++i)
     m_engine->connect_port(i, &m_controls[i]);
-    
-  // create GUI objects, initialise knobs and drawbars, connect signals
-  m_kit = new Gtk::Main(argc, argv);
-  m_win = new Gtk::Window;
-  m_gui = new AZR3GUI;
-  for (int i = 0; i < 128; ++i) {
-    if (!m_presets[i].empty)
-      m_gui->add_program(i, m_presets[i].name.c_str());
-  }
-  m_gui->signal_set_control.
-    connect(sigc::mem_fun(*this, &Main::gui_changed_control));
-  m_gui->signal_set_program.
-    connect(sigc::mem_fun(*this, &Main::gui_set_preset));
-  m_gui->signal_save_program.
-    connect(sigc::mem_fun(*this, &Main::gui_save_preset));
-  for (uint32_t i = 0; i < 63; ++i)
-    m_gui->set_control(i, m_gui_controls[i]);
-    
-  // try to load the desired preset, if it doesn't work use the first one
+  m_engine->set_midi_map(m_midi_map);
+  
+  // the engine handles MIDI program changes itself
+  for (int i = 0; i < 128; ++i)
+    m_engine->set_program(i, m_presets[i].empty ? 0 : m_presets[i].values);
+  
+  // try to load the desired preset, if it doesn't work use the first one,
+  // the first process() call will pass it to the engine
+  int preset = -1;
   if (preset_no < 128 && !m_presets[preset_no].empty)
-    gui_set_preset(preset_no);
+    preset = preset_no;
   else {
     for (int i = 0; i < 128; ++i) {
       if (!m_presets[i].empty) {
-	gui_set_preset(i);
+	preset = i;
 	break;
       }
     }
   }
+  if (preset >= 0)
+    gui_set_preset(preset);
     
   // initialise LASH
   if (!init_lash(lash_args, jack_get_client_name(m_jack_client)))
     return;
   
-  m_win->set_title("AZR-3");
-  m_win->set_resizable(false);
-  m_win->add(*m_gui);
-  m_win->show_all();
-    
-  m_ok = true;
-}
-  
+  // open the control socket
+  if (m_headless) {
+    if (socket_path.empty()) {
+      string name = jack_get_client_name(m_jack_client);
+      if (getenv("XDG_RUNTIME_DIR"))
+	socket_path = string(getenv("XDG_RUNTIME_DIR")) + "/azr3-" + 
+	  name + ".socket";
+      else {
+	ostringstream oss;
+	oss<<"/tmp/azr3-"<<name<<"-"<<getuid()<<".socket";
+	socket_path = oss.str();
+      }
+    }
+    try {
+      m_socket = new ControlSocket(socket_path);
+    }
+    catch (runtime_error& e) {
+      cerr<<e.what()<<endl;
+      return;
+    }
+    m_socket->signal_command.
+      connect(sigc::mem_fun(*this, &Main::handle_command));
+    cout<<"Listening for commands on "<<socket_path<<endl;
+  }
   
-void Main::run() {
+  /* start making sound before the GUI is built, the JACK thread doesn't
+     need anything from it */
   m_engine->activate();
   jack_activate(m_jack_client);
-
+  
   // auto-connect JACK ports if desired
   if (!m_started_by_lashd)
     auto_connect();
-
-  Glib::signal_timeout().
-    connect(sigc::bind_return(sigc::mem_fun(*this, &Main::check_changes), 
-			      true), 10);
-  Glib::signal_timeout().
-    connect(sigc::mem_fun(*this, &Main::check_lash_events), 500);
-  m_kit->run(*m_win);
+  
+  // create GUI objects, initialise knobs and drawbars, connect signals
+  if (!m_headless) {
+    m_kit = new Gtk::Main(argc, argv);
+    m_win = new Gtk::Window;
+    m_gui = new AZR3GUI;
+    for (int i = 0; i < 128; ++i) {
+      if (!m_presets[i].empty)
+	m_gui->add_program(i, m_presets[i].name.c_str());
+    }
+    m_gui->signal_set_control.
+      connect(sigc::mem_fun(*this, &Main::gui_changed_control));
+    m_gui->signal_set_program.
+      connect(sigc::mem_fun(*this, &Main::gui_set_preset));
+    m_gui->signal_save_program.
+      connect(sigc::mem_fun(*this, &Main::gui_save_preset));
+    m_gui->signal_learn_control.
+      connect(sigc::mem_fun(*this, &Main::gui_learn_control));
+    for (uint32_t i = 0; i < 63; ++i)
+      m_gui->set_control(i, m_gui_controls[i]);
+    if (preset >= 0)
+      m_gui->set_program(preset);
+    
+    m_win->set_title("AZR-3");
+    m_win->set_resizable(false);
+    m_win->add(*m_gui);
+    m_win->show_all();
+  }
+    
+  m_ok = true;
+}
+  
+  
+void Main::run() {
+  if (m_headless) {
+    run_headless();
+    delete m_socket;
+    m_socket = 0;
+  }
+  else {
+    Glib::signal_io().connect(sigc::mem_fun(*this, &Main::wake_up), 
+			      m_wake_fd, Glib::IO_IN);
+    m_kit->run(*m_win);
+  }
   jack_deactivate(m_jack_client);
   m_engine->deactivate();
 }
+
+
+void Main::run_headless() {
   
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  int signal_fd = signalfd(-1, &signals, SFD_CLOEXEC);
+  if (signal_fd < 0) {
+    cerr<<"Could not create a signalfd: "<<strerror(errno)<<endl;
+    return;
+  }
   
-bool Main::is_ok() const {
-  return m_ok;
+  // LASH has no file descriptor of its own, so it has to be polled
+  int timeout = (m_lash_client ? 500 : -1);
+  
+  vector<pollfd> fds;
+  while (!m_quit) {
+    fds.clear();
+    pollfd pfd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    pfd.fd = signal_fd;
+    fds.push_back(pfd);
+    pfd.fd = m_wake_fd;
+    fds.push_back(pfd);
+    m_socket->add_pollfds(fds);
+    
+    if (poll(&fds[0], fds.size(), timeout) < 0) {
+      if (errno == EINTR)
+	continue;
+      cerr<<"poll() failed: "<<strerror(errno)<<endl;
+      break;
+    }
+    
+    if (fds[0].revents) {
+      signalfd_siginfo info;
+      if (read(signal_fd, &info, sizeof(info)) == sizeof(info))
+	cerr<<"Received "<<strsignal(info.ssi_signo)<<", quitting"<<endl;
+      break;
+    }
+    if (fds[1].revents)
+      wake_up(Glib::IO_IN);
+    m_socket->handle(fds);
+    if (m_lash_client)
+      check_lash_events();
+  }
+  
+  close(signal_fd);
 }
 
+
+string Main::handle_command(const string& line) {
+  istringstream iss(line);
+  string command;
+  iss>>command;
+  ostringstream reply;
   
-void Main::load_presets(char const* file) {
-  ifstream fin(file);
-  fin>>ws;
-  while (fin.good()) {
+  // set a control
+  if (command == "set") {
+    int index;
+    float value;
+    if (!(iss>>index>>value) || index < 0 || index >= 63)
+      return "error usage: set INDEX VALUE\n";
+    if (value < 0)
+      value = 0;
+    else if (value > 1)
+      value = 1;
+    gui_changed_control(index, value);
+    return "ok\n";
+  }
+  
+  // get one control, or all of them
+  else if (command == "get") {
+    int index;
+    if (iss>>index) {
+      if (index < 0 || index >= 63)
+	return "error no such control\n";
+      reply<<"value "<<index<<" "<<m_gui_controls[index]<<"\n";
+    }
+    else {
+      reply<<"values";
+      for (uint32_t i = 0; i < 63; ++i)
+	reply<<" "<<m_gui_controls[i];
+      reply<<"\n";
+    }
+  }
+  
+  // load a preset
+  else if (command == "preset") {
     int number;
-    fin>>number;
-    if (number < 0 && number > 127) {
-      cerr<<"Invalid program number: "<<number<<endl
-	  <<"Skipping the rest of "<<file<<endl;
-      break;
+    if (!(iss>>number) || number < 0 || number > 127)
+      return "error usage: preset NUMBER\n";
+    if (m_presets[number].empty)
+      return "error no such preset\n";
+    gui_set_preset(number);
+    return "ok\n";
+  }
+  
+  // morph between two presets over some seconds or with a MIDI controller
+  else if (command == "morph") {
+    int from, to;
+    string how;
+    if (!(iss>>from>>to>>how) || from < 0 || from > 127 || 
+	to < 0 || to > 127)
+      return "error usage: morph FROM TO SECONDS|cc NUMBER\n";
+    if (how == "cc") {
+      int cc;
+      if (!(iss>>cc) || cc < 0 || cc > 127)
+	return "error usage: morph FROM TO SECONDS|cc NUMBER\n";
+      m_engine->morph(from, to, 0, cc);
     }
-    for (int i = 0; i < 63; ++i) {
-      float value;
-      fin>>value;
-      m_presets[number].values[i] = value;
-      fin>>ws;
+    else {
+      istringstream hiss(how);
+      float seconds;
+      if (!(hiss>>seconds) || seconds < 0)
+	return "error usage: morph FROM TO SECONDS|cc NUMBER\n";
+      m_engine->morph(from, to, seconds);
     }
-    getline(fin, m_presets[number].name);
-    fin>>ws;
-    m_presets[number].empty = false;
-    cout<<"Loaded program "<<number<<": "<<m_presets[number].name<<endl;
+    return "ok\n";
   }
+  
+  // bind the next MIDI controller that moves to a control
+  else if (command == "learn") {
+    string what;
+    int index;
+    if (!(iss>>what))
+      return "error usage: learn INDEX|off\n";
+    if (what == "off")
+      m_engine->midi_learn(-1);
+    else {
+      istringstream wiss(what);
+      if (!(wiss>>index) || index < 0 || index >= 63)
+	return "error usage: learn INDEX|off\n";
+      m_engine->midi_learn(index);
+    }
+    return "ok\n";
+  }
+  
+  // list the MIDI bindings, or load new ones
+  else if (command == "map") {
+    string what;
+    if (iss>>what) {
+      string file;
+      if (what != "load" || !getline(iss>>ws, file) || file.empty())
+	return "error usage: map [load FILE]\n";
+      if (!load_midi_map(file))
+	return "error could not load " + file + "\n";
+      m_engine->set_midi_map(m_midi_map);
+      return "ok\n";
+    }
+    const vector<MidiBinding>& bindings = m_midi_map.get_bindings();
+    for (unsigned i = 0; i < bindings.size(); ++i)
+      reply<<"binding "<<MidiMap::format(bindings[i])<<"\n";
+    reply<<"end\n";
+  }
+  
+  // when the engine has handled the MIDI events
+  else if (command == "timing") {
+    string what;
+    if (iss>>what) {
+      if (what != "reset")
+	return "error usage: timing [reset]\n";
+      m_engine->reset_midi_timing();
+      return "ok\n";
+    }
+    // the engine only changes the statistics while it runs a cycle
+    MidiTiming timing;
+    int tries = 0;
+    while (!m_engine->get_midi_timing(timing)) {
+      if (++tries == 100)
+	return "error the statistics are busy\n";
+      usleep(1000);
+    }
+    print_midi_timing(timing, reply);
+  }
+  
+  // list the presets
+  else if (command == "presets") {
+    for (int i = 0; i < 128; ++i) {
+      if (!m_presets[i].empty)
+	reply<<"preset "<<i<<" "<<m_presets[i].name<<"\n";
+    }
+    reply<<"end\n";
+  }
+  
+  // save the current controls as a preset
+  else if (command == "save") {
+    int number;
+    string name;
+    if (!(iss>>number) || number < 0 || number > 127)
+      return "error usage: save NUMBER NAME\n";
+    getline(iss>>ws, name);
+    if (name.empty())
+      return "error usage: save NUMBER NAME\n";
+    gui_save_preset(number, name);
+    return "ok\n";
+  }
+  
+  // engine statistics
+  else if (command == "stats") {
+    reply<<"samplerate "<<jack_get_sample_rate(m_jack_client)<<"\n"
+	 <<"buffersize "<<jack_get_buffer_size(m_jack_client)<<"\n"
+	 <<"load "<<jack_cpu_load(m_jack_client)<<"\n"
+	 <<"xruns "<<m_xruns<<"\n"
+	 <<"program "<<int(m_program)<<"\n";
+  }
+  
+  else if (command == "quit") {
+    m_quit = true;
+    return "ok\n";
+  }
+  
+  else
+    return "error unknown command '" + command + "'\n";
+  
+  return reply.str();
+}
+  
+  
+bool Main::is_ok() const {
+  return m_ok;
+}
+
+
+int Main::get_exit_status() const {
+  return m_exit_status;
+}
+
+  
+void Main::load_presets(char const* file) {
+  string error;
+  int loaded = PresetFile::load(file, m_presets, error);
+  if (loaded < 0)
+    cerr<<"Could not load presets from "<<file<<": "<<error<<endl;
+  else if (loaded)
+    cout<<"Loaded "<<loaded<<" programs from "<<file<<endl;
 }
 
 
 void Main::write_presets(char const* file) {
-  ofstream fout(file);
-  for (unsigned char i = 0; i < 128; ++i) {
-    if (!m_presets[i].empty) {
-      fout<<int(i);
-      for (uint32_t p = 0; p < 63; ++p)
-	fout<<" "<<m_presets[i].values[p];
-      fout<<" "<<m_presets[i].name<<endl;
-    }
+  string error;
+  if (!PresetFile::save(file, m_presets, error))
+    cerr<<"Could not write presets to "<<file<<": "<<error<<endl;
+}
+
+
+bool Main::load_midi_map(const string& file) {
+  string error;
+  if (!m_midi_map.load(file, error)) {
+    cerr<<"Could not load the MIDI map "<<file<<": "<<error<<endl;
+    return false;
   }
+  return true;
+}
+
+
+void Main::write_midi_map(const string& file) {
+  string error;
+  if (!m_midi_map.save(file, error))
+    cerr<<"Could not write the MIDI map to "<<file<<": "<<error<<endl;
 }
 
 
@@ -257,9 +633,17 @@ void Main::gui_set_preset(unsigned char number) {
     m_program = number;
     pthread_mutex_unlock(&m_gui_wlock);
     sem_post(&m_gui_changed);
-    for (int i = 0; i < 63; ++i)
-      m_gui->set_control(i, m_presets[number].values[i]);
-    m_gui->set_program(number);
+    if (m_gui) {
+      for (int i = 0; i < 63; ++i)
+	m_gui->set_control(i, m_presets[number].values[i]);
+      m_gui->set_program(number);
+    }
+    
+    // have the wavetables ready if the user steps through the programs
+    if (number > 0)
+      m_engine->prepare_program(number - 1);
+    if (number < 127)
+      m_engine->prepare_program(number + 1);
   }
 }
 
@@ -269,45 +653,68 @@ void Main::gui_save_preset(unsigned char number, const string& name) {
     m_presets[number].empty = false;
     memcpy(&m_presets[number].values[0], m_gui_controls, sizeof(float) * 63);
     m_presets[number].name = name;
-    m_gui->add_program(number, name.c_str());
-    m_gui->set_program(number);
+    m_engine->set_program(number, m_presets[number].values);
+    if (m_gui) {
+      m_gui->add_program(number, name.c_str());
+      m_gui->set_program(number);
+    }
     m_program = number;
     if (getenv("HOME")) {
       char buf[512];
       snprintf(buf, 512, "%s/.azr3_jack_presets", getenv("HOME"));
-      write_presets(buf);
+      m_file_writer.write(buf, PresetFile::to_text(m_presets));
     }
   }
 }
   
 
-bool Main::engine_changed_control(uint32_t index, float value) {
-  if (pthread_mutex_trylock(&m_engine_wlock))
-    return false;
-  m_controls[index] = value;
-  pthread_mutex_unlock(&m_engine_wlock);
-  sem_post(&m_engine_changed);
-  return true;
+void Main::gui_learn_control(uint32_t index) {
+  m_engine->midi_learn(index);
+  if (m_gui)
+    m_gui->show_message("Move a MIDI controller");
 }
-  
+
 
 void Main::check_changes() {
-  static float tmp[63];
-  if (!sem_trywait(&m_engine_changed)) {
-    while (!sem_trywait(&m_engine_changed));
-    pthread_mutex_lock(&m_engine_wlock);
-    memcpy(tmp, m_controls, sizeof(float) * 63);
-    pthread_mutex_unlock(&m_engine_wlock);
-    for (uint32_t i = 0; i < 63; ++i) {
-      if (tmp[i] != m_gui_controls[i]) {
-	m_gui_controls[i] = tmp[i];
-	m_gui->set_control(i, tmp[i]);
+  
+  // only look at the controls that the engine says it has changed, unless
+  // it has lost track of them
+  uint32_t index;
+  while (m_engine->get_changed_control(index)) {
+    uint32_t first = (index < 63 ? index : 0);
+    uint32_t last = (index < 63 ? index + 1 : 63);
+    for (uint32_t i = first; i < last; ++i) {
+      float value = m_controls[i];
+      if (value != m_gui_controls[i]) {
+	m_gui_controls[i] = value;
+	if (m_gui)
+	  m_gui->set_control(i, value);
       }
     }
   }
+  
+  // the engine has switched to the program already, and the controls have
+  // been copied above
   if (!sem_trywait(&m_program_changed)) {
     while (!sem_trywait(&m_program_changed));
-    gui_set_preset(m_program);
+    if (m_gui)
+      m_gui->set_program(m_program);
+  }
+  
+  // a learned binding replaces the old ones for the controller and the
+  // control, and is saved right away in the background
+  MidiBinding binding;
+  bool learned = false;
+  while (m_engine->get_learned_binding(binding)) {
+    m_midi_map.learn(binding);
+    learned = true;
+    if (m_gui)
+      m_gui->show_message("MIDI: " + MidiMap::describe(binding));
+  }
+  if (learned) {
+    m_engine->set_midi_map(m_midi_map);
+    if (!m_midi_map_file.empty())
+      m_file_writer.write(m_midi_map_file, m_midi_map.to_text());
   }
 }
 
@@ -325,20 +732,67 @@ int Main::process(jack_nframes_t nframes) {
     }
   }
     
-  m_engine->connect_port(63, jack_port_get_buffer(m_midi_port, nframes));
-  m_engine->connect_port(64, jack_port_get_buffer(m_left_port, nframes));
-  m_engine->connect_port(65, jack_port_get_buffer(m_right_port, nframes));
+  // the engine renders straight into the JACK buffers
+  ProcessContext ctx;
+  ctx.nframes = nframes;
+  
+  // the events point into the JACK buffer, only the headers are copied
+  void* midi = jack_port_get_buffer(m_midi_port, nframes);
+  ctx.event_count = jack_midi_get_event_count(midi, nframes);
+  if (ctx.event_count > sizeof(m_midi_events) / sizeof(m_midi_events[0]))
+    ctx.event_count = sizeof(m_midi_events) / sizeof(m_midi_events[0]);
+  for (uint32_t i = 0; i < ctx.event_count; ++i) {
+    jack_midi_event_t event;
+    jack_midi_event_get(&event, midi, i, nframes);
+    m_midi_events[i].time = event.time;
+    m_midi_events[i].size = event.size;
+    m_midi_events[i].data = event.buffer;
+  }
+  ctx.events = m_midi_events;
+  
+  ctx.input[0] = 
+    static_cast<float*>(jack_port_get_buffer(m_in_left_port, nframes));
+  ctx.input[1] = 
+    static_cast<float*>(jack_port_get_buffer(m_in_right_port, nframes));
+  ctx.output[0] = 
+    static_cast<float*>(jack_port_get_buffer(m_left_port, nframes));
+  ctx.output[1] = 
+    static_cast<float*>(jack_port_get_buffer(m_right_port, nframes));
+  if (m_extra_ports[0]) {
+    float* extra[port_speaker_right - port_upper + 1];
+    for (int i = 0; i <= port_speaker_right - port_upper; ++i)
+      extra[i] = 
+	static_cast<float*>(jack_port_get_buffer(m_extra_ports[i], nframes));
+    ctx.dry[0] = extra[0];
+    ctx.dry[1] = extra[1];
+    ctx.dry[2] = extra[2];
+    ctx.prespeaker = extra[3];
+    ctx.speaker[0] = extra[4];
+    ctx.speaker[1] = extra[5];
+  }
+  jack_position_t pos;
+  ctx.transport_rolling = 
+    (jack_transport_query(m_jack_client, &pos) == JackTransportRolling);
+  ctx.transport_frame = pos.frame;
     
   // XXX It isn't really safe to write automated changes here since the GUI
   //     may be reading from the control values - the mutex isn't locked
-  m_engine->run(nframes);
+  m_engine->process(ctx);
     
-  if (m_engine->controls_has_changed())
-    sem_post(&m_engine_changed);
+  bool changed = m_engine->controls_has_changed();
   unsigned char prog = m_engine->received_program_change();
   if (prog != 255) {
     m_program = prog;
     sem_post(&m_program_changed);
+    changed = true;
+  }
+  
+  // wake up the main loop
+  if (changed) {
+    uint64_t one = 1;
+    // this only fails when the counter is full, and then it's awake anyway
+    if (write(m_wake_fd, &one, sizeof(one)) < 0)
+      return 0;
   }
     
   return 0;
@@ -360,6 +814,7 @@ bool Main::check_lash_events() {
 	fout<<" "<<m_gui_controls[i];
       fout<<endl;
       write_presets((dir + "/presets").c_str());
+      write_midi_map(dir + "/midimap");
       lash_send_event(m_lash_client, 
 		      lash_event_new_with_type(LASH_Save_File));
     }
@@ -371,19 +826,38 @@ bool Main::check_lash_events() {
       for (unsigned char i = 0; i < 128; ++i)
 	m_presets[i].empty = true;
       load_presets((dir + "/presets").c_str());
-      m_gui->clear_programs();
-      for (unsigned char i = 0; i < 128; ++i) {
-	if (!m_presets[i].empty)
-	  m_gui->add_program(i, m_presets[i].name.c_str());
+      if (load_midi_map(dir + "/midimap"))
+	m_engine->set_midi_map(m_midi_map);
+      for (unsigned char i = 0; i < 128; ++i)
+	m_engine->set_program(i, m_presets[i].empty ?
+			      0 : m_presets[i].values);
+      if (m_gui) {
+	m_gui->clear_programs();
+	for (unsigned char i = 0; i < 128; ++i) {
+	  if (!m_presets[i].empty)
+	    m_gui->add_program(i, m_presets[i].name.c_str());
+	}
       }
       ifstream fin((dir + "/state").c_str());
       int prog;
       fin>>prog;
-      m_gui->set_program(prog);
+      if (m_gui)
+	m_gui->set_program(prog);
+      else
+	m_program = prog;
+      float values[63];
       for (uint32_t p = 0; p < 63; ++p) {
-	float tmp;
-	fin>>tmp;
-	m_gui->set_control(p, tmp);
+	fin>>values[p];
+	if (m_gui)
+	  m_gui->set_control(p, values[p]);
+      }
+      
+      // without a GUI there is nobody to forward the values to the engine
+      if (!m_gui) {
+	pthread_mutex_lock(&m_gui_wlock);
+	memcpy(m_gui_controls, values, sizeof(values));
+	pthread_mutex_unlock(&m_gui_wlock);
+	sem_post(&m_gui_changed);
       }
       lash_send_event(m_lash_client, 
 		      lash_event_new_with_type(LASH_Restore_File));
@@ -392,7 +866,9 @@ bool Main::check_lash_events() {
     // quit
     else if (lash_event_get_type(event) == LASH_Quit) {
       cerr<<"Received LASH Quit command"<<endl;
-      Gtk::Main::instance()->quit();
+      if (m_kit)
+	Gtk::Main::instance()->quit();
+      m_quit = true;
       go_on = false;
     }
     
@@ -411,8 +887,9 @@ bool Main::init_lash(lash_args_t* lash_args, const std::string& jack_name) {
     lash_event_set_string(event, "AZR-3");
     lash_send_event(m_lash_client, event);      
     lash_jack_client_name(m_lash_client, jack_name.c_str());
-    Glib::signal_timeout().
-      connect(sigc::mem_fun(*this, &Main::check_lash_events), 500);
+    if (!m_headless)
+      Glib::signal_timeout().
+	connect(sigc::mem_fun(*this, &Main::check_lash_events), 500);
   }
   else
     cerr<<"Could not initialise LASH!"<<endl;
@@ -420,11 +897,25 @@ bool Main::init_lash(lash_args_t* lash_args, const std::string& jack_name) {
 }
   
   
+bool Main::wake_up(Glib::IOCondition) {
+  uint64_t count;
+  if (read(m_wake_fd, &count, sizeof(count)) == sizeof(count))
+    check_changes();
+  return true;
+}
+
+
 int Main::static_process(jack_nframes_t frames, void* arg) {
   return static_cast<Main*>(arg)->process(frames);
 }
 
 
+int Main::static_xrun(void* arg) {
+  ++static_cast<Main*>(arg)->m_xruns;
+  return 0;
+}
+
+
 void Main::auto_connect() {
 
   const char** port_list;
@@ -471,6 +962,31 @@ void Main::auto_connect() {
 		   jack_port_name(m_right_port), m_auto_audio.c_str());
     }
   }
+
+  // audio input
+  if (m_auto_input != "") {
+    
+    // if it's a client, connect individual ports
+    if (m_auto_input.find(':') == string::npos &&
+	(port_list = jack_get_ports(m_jack_client, 
+				    (m_auto_input + ":*").c_str(),
+				    JACK_DEFAULT_AUDIO_TYPE, 
+				    JackPortIsOutput)) && port_list[0]) {
+      jack_connect(m_jack_client, port_list[0], 
+		   jack_port_name(m_in_left_port));
+      jack_connect(m_jack_client, port_list[1] ? port_list[1] : port_list[0],
+		   jack_port_name(m_in_right_port));
+      free(port_list);
+    }
+
+    // if not, connect that single port to both our inputs
+    else {
+      jack_connect(m_jack_client, 
+		   m_auto_input.c_str(), jack_port_name(m_in_left_port));
+      jack_connect(m_jack_client, 
+		   m_auto_input.c_str(), jack_port_name(m_in_right_port));
+    }
+  }
 }
 
 
@@ -479,5 +995,5 @@ int main(int argc, char** argv) {
   Main m(argc, argv);
   if (m.is_ok())
     m.run();
-  return 0;
+  return m.get_exit_status();
 }
@@ -29,14 +29,11 @@
 
 #include "azr3.hpp"
 #include "azr3gui.hpp"
-
-
-struct Preset {
-  Preset() : empty(true) { }
-  std::string name;
-  float values[63];
-  bool empty;
-};
+#include "controlsocket.hpp"
+#include "filewriter.hpp"
+#include "midimap.hpp"
+#include "miditiming.hpp"
+#include "presetfile.hpp"
 
 
 struct Main {
@@ -47,6 +44,9 @@ struct Main {
   
   bool is_ok() const;
   
+  /** The exit status for the program. */
+  int get_exit_status() const;
+  
 protected:
   
   void load_presets(char const* file);
@@ -59,10 +59,22 @@ protected:
 
   void gui_save_preset(unsigned char number, const std::string& name);
 
-  bool engine_changed_control(uint32_t index, float value);
+  /** Bind the next MIDI controller that moves to a control. */
+  void gui_learn_control(uint32_t index);
+
+  /** Read a MIDI map into m_midi_map. The engine only uses it after
+      AZR3::set_midi_map(). Returns false if the file is broken. */
+  bool load_midi_map(const std::string& file);
+
+  void write_midi_map(const std::string& file);
 
+  /** Copy the controls that the engine has changed to the GUI. */
   void check_changes();
 
+  /** Called in the main loop when the JACK thread has written to 
+      m_wake_fd. */
+  bool wake_up(Glib::IOCondition condition);
+
   int process(jack_nframes_t nframes);
 
   bool check_lash_events();
@@ -73,15 +85,27 @@ protected:
 
   static int static_process(jack_nframes_t frames, void* arg);
 
+  static int static_xrun(void* arg);
+
+  /** The main loop without a GUI. It sleeps in poll() until a command
+      arrives on the control socket, the engine has changed something,
+      or a signal asks us to quit. */
+  void run_headless();
+
+  /** Execute a command from the control socket and return the reply. */
+  std::string handle_command(const std::string& line);
+
 
   jack_client_t* m_jack_client;
   jack_port_t* m_midi_port;
   jack_port_t* m_left_port;
   jack_port_t* m_right_port;
+  jack_port_t* m_in_left_port;
+  jack_port_t* m_in_right_port;
+  jack_port_t* m_extra_ports[port_speaker_right - port_upper + 1];
+  MidiEvent m_midi_events[1024];
   AZR3* m_engine;
   AZR3GUI* m_gui;
-  pthread_mutex_t m_engine_wlock;
-  sem_t m_engine_changed;
   sem_t m_program_changed;
   float m_controls[63];
   unsigned char m_program;
@@ -89,14 +113,29 @@ protected:
   sem_t m_gui_changed;
   float m_gui_controls[63];
   Preset m_presets[128];
+  /** Saves the user's presets and MIDI map without blocking the GUI. */
+  FileWriter m_file_writer;
+  /** The MIDI bindings and the file that learned bindings are saved in. */
+  MidiMap m_midi_map;
+  std::string m_midi_map_file;
   lash_client_t* m_lash_client;
 
   bool m_ok;
+  int m_exit_status;
   bool m_started_by_lashd;
   std::string m_auto_midi;
   std::string m_auto_audio;
+  std::string m_auto_input;
   
   Gtk::Main* m_kit;
   Gtk::Window* m_win;
+  
+  bool m_headless;
+  bool m_quit;
+  ControlSocket* m_socket;
+  /** An eventfd that the JACK thread writes to when the engine has changed
+      controls or the program. */
+  int m_wake_fd;
+  volatile int m_xruns;
 
 };
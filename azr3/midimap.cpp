@@ -0,0 +1,320 @@
+/****************************************************************************
+
+    midimap.cpp - Mapping MIDI controllers to the organ controls
+
+    Copyright (C) 2026 agent <agent@local>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as published
+    by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 01222-1307  USA
+
+****************************************************************************/
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <sstream>
+
+#include "filewriter.hpp"
+#include "globals.hpp"
+#include "midimap.hpp"
+
+
+using namespace std;
+
+
+namespace {
+
+  // the controls of the original AZR-3, indexed by CC number, kNumParams
+  // means that the CC isn't used
+  const int N = kNumParams;
+  const int default_cc_map[120] = {
+     N, 49,  1,  2,  3,  4,  5, 10,  6,  7,  8,  9, 11, 12, 13, 14,
+    15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30,
+    31, 32, 33, 34, 35, 36, 37, 38, 39, 40, 41, 42, 43, 44, 45, 46,
+    47, 48, 50, 51, 52, 53, 54, 55, 56, 57, 58, 59, 60, 61, 62,  N,
+     N,  N,  N,  N,  N,  N,  N,  N,  N,  N,  N,  N,  N,  N,  N,  N,
+     N,  N,  N,  N,  N,  N,  N,  N,  N,  N,  N,  N,  N,  N,  N,  N,
+     N,  N,  N,  N,  N,  N,  N,  N,  N,  N,  N,  N,  N,  N,  N,  N,
+     N,  N,  N,  N,  N,  N,  N,  N
+  };
+
+  const char* curve_names[] = { "linear", "exp", "log", "toggle", "flip" };
+  const int num_curves = sizeof(curve_names) / sizeof(curve_names[0]);
+
+}
+
+
+MidiMap::MidiMap() {
+  for (int i = 0; i < 120; ++i) {
+    if (default_cc_map[i] == kNumParams)
+      continue;
+    MidiBinding binding;
+    binding.number = i;
+    binding.control = default_cc_map[i];
+    m_bindings.push_back(binding);
+  }
+}
+
+
+void MidiMap::clear() {
+  m_bindings.clear();
+}
+
+
+void MidiMap::add(const MidiBinding& binding) {
+  m_bindings.push_back(binding);
+}
+
+
+void MidiMap::learn(const MidiBinding& binding) {
+  vector<MidiBinding>::iterator iter = m_bindings.begin();
+  while (iter != m_bindings.end()) {
+    bool same_source = (iter->type == binding.type &&
+			iter->number == binding.number &&
+			(iter->channel == binding.channel ||
+			 iter->channel == -1 || binding.channel == -1));
+    if (same_source || iter->control == binding.control)
+      iter = m_bindings.erase(iter);
+    else
+      ++iter;
+  }
+  m_bindings.push_back(binding);
+}
+
+
+const vector<MidiBinding>& MidiMap::get_bindings() const {
+  return m_bindings;
+}
+
+
+bool MidiMap::load(const string& file, string& error) {
+  error.clear();
+  ifstream fin(file.c_str());
+  if (!fin) {
+    if (errno == ENOENT)
+      return true;
+    error = strerror(errno);
+    return false;
+  }
+
+  vector<MidiBinding> bindings;
+  string line;
+  int line_number = 0;
+  while (getline(fin, line)) {
+    ++line_number;
+    string::size_type start = line.find_first_not_of(" \t\r");
+    if (start == string::npos || line[start] == '#')
+      continue;
+    MidiBinding binding;
+    if (!parse(line, binding)) {
+      ostringstream oss;
+      oss<<"Invalid binding on line "<<line_number;
+      error = oss.str();
+      return false;
+    }
+    bindings.push_back(binding);
+  }
+
+  m_bindings.swap(bindings);
+  return true;
+}
+
+
+string MidiMap::to_text() const {
+  ostringstream oss;
+  oss<<"# cc|nrpn CHANNEL|all NUMBER CONTROL [CURVE [MIN MAX]]\n";
+  for (unsigned i = 0; i < m_bindings.size(); ++i)
+    oss<<format(m_bindings[i])<<"\n";
+  return oss.str();
+}
+
+
+bool MidiMap::save(const string& file, string& error) const {
+  return write_file_atomically(file, to_text(), error);
+}
+
+
+string MidiMap::format(const MidiBinding& binding) {
+  ostringstream oss;
+  oss<<(binding.type == MidiBinding::nrpn ? "nrpn " : "cc ");
+  if (binding.channel < 0)
+    oss<<"all ";
+  else
+    oss<<(binding.channel + 1)<<" ";
+  oss<<binding.number<<" "<<control_symbols[binding.control];
+  if (binding.curve != MidiBinding::linear ||
+      binding.min != 0 || binding.max != 1) {
+    oss<<" "<<curve_names[binding.curve];
+    if (binding.min != 0 || binding.max != 1)
+      oss<<" "<<binding.min<<" "<<binding.max;
+  }
+  return oss.str();
+}
+
+
+bool MidiMap::parse(const string& line, MidiBinding& binding) {
+  istringstream iss(line);
+  string type, channel, control, curve;
+  int number;
+  if (!(iss>>type>>channel>>number>>control))
+    return false;
+
+  if (type == "cc")
+    binding.type = MidiBinding::cc;
+  else if (type == "nrpn")
+    binding.type = MidiBinding::nrpn;
+  else
+    return false;
+  if (number < 0 || number > (binding.type == MidiBinding::cc ? 119 : 16383))
+    return false;
+  binding.number = number;
+
+  if (channel == "all")
+    binding.channel = -1;
+  else {
+    char* end;
+    long c = strtol(channel.c_str(), &end, 10);
+    if (*end || c < 1 || c > 16)
+      return false;
+    binding.channel = c - 1;
+  }
+
+  int i;
+  for (i = 0; i < kNumParams; ++i) {
+    if (control == control_symbols[i])
+      break;
+  }
+  if (i == kNumParams)
+    return false;
+  binding.control = i;
+
+  binding.curve = MidiBinding::linear;
+  binding.min = 0;
+  binding.max = 1;
+  if (iss>>curve) {
+    for (i = 0; i < num_curves; ++i) {
+      if (curve == curve_names[i])
+	break;
+    }
+    if (i == num_curves)
+      return false;
+    binding.curve = i;
+    float min, max;
+    if (iss>>min) {
+      if (!(iss>>max) || !(min >= 0 && min <= 1 && max >= 0 && max <= 1))
+	return false;
+      binding.min = min;
+      binding.max = max;
+    }
+  }
+
+  // anything left over is a mistake
+  string rest;
+  return !(iss>>rest);
+}
+
+
+string MidiMap::describe(const MidiBinding& binding) {
+  ostringstream oss;
+  oss<<(binding.type == MidiBinding::nrpn ? "NRPN " : "CC ")<<binding.number;
+  if (binding.channel >= 0)
+    oss<<" ch "<<(binding.channel + 1);
+  return oss.str();
+}
+
+
+CompiledMidiMap::CompiledMidiMap(const MidiMap& map) {
+
+  for (int c = 0; c < 16; ++c) {
+    for (int n = 0; n < 128; ++n)
+      m_cc[c][n] = -1;
+  }
+
+  // a binding for all channels is linked into the chain of every channel
+  std::map<uint32_t, int> nrpn;
+  const vector<MidiBinding>& bindings = map.get_bindings();
+  for (unsigned i = 0; i < bindings.size(); ++i) {
+    const MidiBinding& b = bindings[i];
+    Target target = { b.control, b.curve, b.min, b.max, -1, 0 };
+    int first = (b.channel < 0 ? 0 : b.channel);
+    int last = (b.channel < 0 ? 15 : b.channel);
+    for (int c = first; c <= last; ++c) {
+      if (b.type == MidiBinding::cc) {
+	int head = m_cc[c][b.number];
+	link(head, target);
+	m_cc[c][b.number] = head;
+      }
+      else {
+	uint32_t key = (c << 14) | b.number;
+	if (nrpn.find(key) == nrpn.end())
+	  nrpn[key] = -1;
+	link(nrpn[key], target);
+      }
+    }
+  }
+
+  m_nrpn.assign(nrpn.begin(), nrpn.end());
+}
+
+
+int CompiledMidiMap::find_nrpn(unsigned char channel, int number) const {
+  pair<uint32_t, int> key((channel << 14) | number, -1);
+  vector<pair<uint32_t, int> >::const_iterator iter =
+    lower_bound(m_nrpn.begin(), m_nrpn.end(), key);
+  if (iter == m_nrpn.end() || iter->first != key.first)
+    return -1;
+  return iter->second;
+}
+
+
+float CompiledMidiMap::map_value(Target& target, float value,
+				 float current) {
+  float last = target.last;
+  target.last = value;
+  switch (target.curve) {
+  case MidiBinding::exponential:
+    value *= value;
+    break;
+  case MidiBinding::logarithmic:
+    value = sqrt(value);
+    break;
+  case MidiBinding::toggle:
+    value = (value >= 0.5f ? 1 : 0);
+    break;
+  case MidiBinding::flip:
+    if (value < 0.5f || last >= 0.5f)
+      return current;
+    value = (fabs(current - target.min) < fabs(current - target.max) ?
+	     1 : 0);
+    break;
+  }
+  return target.min + value * (target.max - target.min);
+}
+
+
+void CompiledMidiMap::link(int& first, const Target& target) {
+  m_targets.push_back(target);
+  int index = m_targets.size() - 1;
+  if (first < 0) {
+    first = index;
+    return;
+  }
+  int last = first;
+  while (m_targets[last].next >= 0)
+    last = m_targets[last].next;
+  m_targets[last].next = index;
+}
@@ -0,0 +1,186 @@
+/****************************************************************************
+
+    midimap.hpp - Mapping MIDI controllers to the organ controls
+
+    Copyright (C) 2026 agent <agent@local>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as published
+    by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 01222-1307  USA
+
+****************************************************************************/
+
+#ifndef MIDIMAP_HPP
+#define MIDIMAP_HPP
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+
+/** One rule in a MidiMap: a controller on a channel that moves a control.
+    The controller value is scaled to [0, 1], shaped by the curve and then
+    mapped to [min, max], so min > max inverts the controller. */
+struct MidiBinding {
+
+  enum Type {
+    cc,
+    nrpn
+  };
+
+  enum Curve {
+    /** Follow the controller. */
+    linear,
+    /** Squared, more resolution at the low end. */
+    exponential,
+    /** Square root, more resolution at the high end. */
+    logarithmic,
+    /** max when the controller is in the upper half, min otherwise. */
+    toggle,
+    /** Switch between min and max every time the controller goes to the
+	upper half, for buttons that send a value when they are pressed
+	and another one when they are released. */
+    flip
+  };
+
+  MidiBinding()
+    : type(cc), channel(-1), number(0), control(0), curve(linear),
+      min(0), max(1) { }
+
+  int type;
+  /** 0 to 15, or -1 for all channels. */
+  int channel;
+  /** 0 to 127 for CCs, 0 to 16383 for NRPNs. */
+  int number;
+  uint32_t control;
+  int curve;
+  float min;
+  float max;
+};
+
+
+/** A list of MIDI bindings that can be read from and written to a file.
+    The file has one binding on each line:
+
+    @verbatim
+    # cc|nrpn CHANNEL|all NUMBER CONTROL [CURVE [MIN MAX]]
+    cc all 7 vol1
+    cc 1 20 1_db1 linear 1 0
+    cc 1 64 speed flip
+    nrpn all 1027 drive exp 0 0.8
+    @endverbatim
+
+    The channels are counted from 1, the controls are named by the symbols
+    in control_symbols and the curves are 'linear', 'exp', 'log', 'toggle'
+    or 'flip'. A map that has just been created has the bindings of the
+    original AZR-3. */
+class MidiMap {
+public:
+
+  MidiMap();
+
+  /** Remove all bindings. */
+  void clear();
+
+  /** Add a binding. */
+  void add(const MidiBinding& binding);
+
+  /** Add a binding that MIDI learn has found. Earlier bindings for the
+      same controller or the same control are removed, so the control
+      only follows the controller it was taught last. */
+  void learn(const MidiBinding& binding);
+
+  const std::vector<MidiBinding>& get_bindings() const;
+
+  /** Replace the bindings with the ones in @c file. Returns false and an
+      error message in @c error if the file can't be read or has errors,
+      the map isn't changed then. A file that doesn't exist is not an
+      error, the map is left alone and @c error is empty. */
+  bool load(const std::string& file, std::string& error);
+
+  /** The file contents for the bindings. */
+  std::string to_text() const;
+
+  /** Write the bindings to @c file with write_file_atomically(), so it
+      always has either the old or the new bindings. Returns false and an
+      error message in @c error if that fails. */
+  bool save(const std::string& file, std::string& error) const;
+
+  /** A line for the file, without the newline. */
+  static std::string format(const MidiBinding& binding);
+
+  /** Parse a line from the file. Returns false if it isn't valid. */
+  static bool parse(const std::string& line, MidiBinding& binding);
+
+  /** A short description of the controller, like "CC 7 ch 1". */
+  static std::string describe(const MidiBinding& binding);
+
+protected:
+
+  std::vector<MidiBinding> m_bindings;
+
+};
+
+
+/** A MidiMap compiled to tables that the audio thread can search without
+    allocating memory or looping through all bindings. A CC is found with
+    one array lookup, an NRPN with a binary search. */
+class CompiledMidiMap {
+public:
+
+  CompiledMidiMap(const MidiMap& map);
+
+  struct Target {
+    uint32_t control;
+    int curve;
+    float min;
+    float max;
+    /** The next target for the same controller, or -1. */
+    int next;
+    /** The last controller value, so MidiBinding::flip can tell when the
+	controller goes to the upper half. */
+    float last;
+  };
+
+  /** The first target of a CC on a channel, or -1. */
+  int find_cc(unsigned char channel, unsigned char number) const {
+    return m_cc[channel][number];
+  }
+
+  /** The first target of an NRPN on a channel, or -1. */
+  int find_nrpn(unsigned char channel, int number) const;
+
+  Target& get_target(int index) {
+    return m_targets[index];
+  }
+
+  /** Map a controller value in [0, 1] to the value for @c target.
+      @c current is the value the control has now, it is only used by
+      MidiBinding::flip. The value is remembered in @c target. */
+  static float map_value(Target& target, float value, float current);
+
+protected:
+
+  /** Add a target to the chain that starts at @c first. */
+  void link(int& first, const Target& target);
+
+  int m_cc[16][128];
+  /** Sorted by key, the channel in the upper bits and the NRPN number in
+      the lower 14. */
+  std::vector<std::pair<uint32_t, int> > m_nrpn;
+  std::vector<Target> m_targets;
+
+};
+
+
+#endif
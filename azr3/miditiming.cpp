@@ -0,0 +1,242 @@
+/****************************************************************************
+
+    miditiming.cpp - Measuring when the engine plays the MIDI events
+
+    Copyright (C) 2026 agent <agent@local>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as published
+    by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 01222-1307  USA
+
+****************************************************************************/
+
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+#include "miditiming.hpp"
+
+
+using namespace std;
+
+
+namespace {
+
+  const double rate = 48000;
+
+  // the note ons are this far apart, which isn't a multiple of any of the
+  // cycle sizes, so they land at different frames in their cycles
+  const uint32_t first_note = 1000;
+  const uint32_t note_spacing = 9001;
+  const uint32_t note_length = 2400;
+  const uint32_t num_notes = 24;
+  const uint32_t test_length = first_note + num_notes * note_spacing;
+
+  // a note has started when there is any output at all. A higher level
+  // would measure the attack too, and the voices step their envelopes in
+  // blocks that are cut short at the cycle boundaries
+  const float threshold = 1e-6f;
+
+  // where the onset is searched, relative to the note on
+  const int search_before = 200;
+
+
+  struct TestNote {
+    uint32_t frame;
+    unsigned char on[3];
+    unsigned char off[3];
+  };
+
+
+  struct TestEvent {
+    uint32_t frame;
+    const unsigned char* data;
+  };
+
+
+  void worker_callback(void* data) {
+    *static_cast<bool*>(data) = true;
+  }
+
+
+  /* Render the test notes with at most @c nframes frames per cycle. The
+     worker is run synchronously after the cycle that needs it, so every
+     run computes the same wavetables at the same time. */
+  void render(const vector<TestNote>& notes, uint32_t nframes,
+	      vector<float>& output, MidiTiming& timing) {
+
+    // one manual with one drawbar, no vibrato, distortion or speakers
+    float controls[kNumParams];
+    for (int i = 0; i < kNumParams; ++i)
+      controls[i] = 0;
+    controls[n_click] = 0.5;
+    controls[n_vol1] = 1;
+    controls[n_master] = 1;
+    controls[n_1_db4] = 1;
+
+    // the engine is too large for the stack
+    AZR3* engine = new AZR3(rate);
+    for (int i = 0; i < kNumParams; ++i)
+      engine->connect_port(i, &controls[i]);
+    bool work = false;
+    engine->set_worker_callback(&worker_callback, &work);
+    engine->set_seed(1);
+    engine->activate();
+
+    // let the worker compute the wavetables before the test starts
+    vector<float> left(test_length), right(test_length);
+    ProcessContext ctx;
+    ctx.nframes = 4096;
+    ctx.output[0] = &left[0];
+    ctx.output[1] = &right[0];
+    engine->process(ctx);
+    if (work) {
+      work = false;
+      engine->do_work();
+    }
+    engine->process(ctx);
+    engine->reset_midi_timing();
+
+    // the notes don't overlap, so the events are sorted like this
+    vector<TestEvent> all_events;
+    for (unsigned i = 0; i < notes.size(); ++i) {
+      TestEvent on = { notes[i].frame, notes[i].on };
+      TestEvent off = { notes[i].frame + note_length, notes[i].off };
+      all_events.push_back(on);
+      all_events.push_back(off);
+    }
+
+    vector<MidiEvent> events;
+    unsigned next = 0;
+    for (uint32_t start = 0; start < test_length; start += ctx.nframes) {
+      ctx.nframes = min(nframes, test_length - start);
+      events.clear();
+      for ( ; next < all_events.size() &&
+	      all_events[next].frame < start + ctx.nframes; ++next) {
+	MidiEvent event = { all_events[next].frame - start, 3,
+			    all_events[next].data };
+	events.push_back(event);
+      }
+      ctx.events = (events.empty() ? 0 : &events[0]);
+      ctx.event_count = events.size();
+      ctx.output[0] = &left[start];
+      ctx.output[1] = &right[start];
+      engine->process(ctx);
+      if (work) {
+	work = false;
+	engine->do_work();
+      }
+    }
+
+    while (!engine->get_midi_timing(timing));
+    engine->deactivate();
+    delete engine;
+    output.swap(left);
+  }
+
+
+  /* The onset of every note relative to its note on, or a large number
+     if the note was silent or the output wasn't silent before it. */
+  vector<int> find_onsets(const vector<TestNote>& notes,
+			  const vector<float>& output) {
+    vector<int> onsets;
+    for (unsigned i = 0; i < notes.size(); ++i) {
+      int onset = note_length;
+      for (int f = -search_before; f < int(note_length); ++f) {
+	if (fabs(output[notes[i].frame + f]) > threshold) {
+	  onset = (f == -search_before ? note_length : f);
+	  break;
+	}
+      }
+      onsets.push_back(onset);
+    }
+    return onsets;
+  }
+
+
+  void print_histogram(const char* name, const uint32_t* buckets,
+		       ostream& out) {
+    out<<name;
+    for (int i = 0; i < MidiTiming::num_buckets; ++i)
+      out<<" "<<buckets[i];
+    out<<"\n";
+  }
+
+}
+
+
+void print_midi_timing(const MidiTiming& timing, ostream& out) {
+  out<<"cycles "<<timing.cycles<<"\n"
+     <<"events "<<timing.events<<"\n"
+     <<"dropped "<<timing.dropped<<"\n"
+     <<"late "<<timing.late<<"\n"
+     <<"maxlatency "<<timing.max_latency<<"\n"
+     <<"nframes "<<(timing.cycles ? timing.min_nframes : 0)<<" "
+     <<timing.max_nframes<<"\n";
+  print_histogram("offsets", timing.offsets, out);
+  print_histogram("notelatency", timing.note_latency, out);
+}
+
+
+bool run_timing_test(ostream& out) {
+
+  vector<TestNote> notes;
+  for (uint32_t i = 0; i < num_notes; ++i) {
+    unsigned char key = 48 + (i * 7) % 36;
+    TestNote note = { first_note + i * note_spacing,
+		      { 0x90, key, 127 }, { 0x80, key, 0 } };
+    notes.push_back(note);
+  }
+
+  // everything in one cycle is the reference, there are no cycle
+  // boundaries that the events could be moved to
+  vector<float> output;
+  MidiTiming timing;
+  render(notes, test_length, output, timing);
+  vector<int> reference = find_onsets(notes, output);
+
+  out<<"Rendering "<<num_notes<<" notes at "<<rate<<" Hz\n\n"
+     <<"frames/cycle  onset (frames)  jitter (frames)  dropped  late\n";
+  bool ok = true;
+  const uint32_t sizes[] = { test_length, 1, 16, 64, 100, 128, 256,
+			     1000, 1024, 4096 };
+  for (unsigned s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+    if (s > 0)
+      render(notes, sizes[s], output, timing);
+    vector<int> onsets = find_onsets(notes, output);
+    int min_onset = onsets[0], max_onset = onsets[0], jitter = 0;
+    for (unsigned i = 0; i < onsets.size(); ++i) {
+      min_onset = min(min_onset, onsets[i]);
+      max_onset = max(max_onset, onsets[i]);
+      jitter = max(jitter, abs(onsets[i] - reference[i]));
+    }
+    if (min_onset < 0 || max_onset >= int(note_length) ||
+	jitter >= rate / 1000 || timing.dropped || timing.late)
+      ok = false;
+    ostringstream onset;
+    onset<<min_onset;
+    if (max_onset != min_onset)
+      onset<<"-"<<max_onset;
+    out<<setw(12)<<sizes[s]<<setw(16)<<onset.str()<<setw(17)<<jitter
+       <<setw(9)<<timing.dropped<<setw(6)<<timing.late<<"\n";
+  }
+
+  out<<"\nThe events with "<<sizes[sizeof(sizes) / sizeof(sizes[0]) - 1]
+     <<" frames/cycle:\n";
+  print_midi_timing(timing, out);
+  out<<"\n"<<(ok ? "PASS" : "FAIL")
+     <<": the notes start at the same frame for all cycle sizes\n";
+
+  return ok;
+}
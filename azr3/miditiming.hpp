@@ -0,0 +1,57 @@
+/****************************************************************************
+
+    miditiming.hpp - Measuring when the engine plays the MIDI events
+
+    Copyright (C) 2026 agent <agent@local>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as published
+    by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 01222-1307  USA
+
+****************************************************************************/
+
+#ifndef MIDITIMING_HPP
+#define MIDITIMING_HPP
+
+#include <iosfwd>
+
+#include "azr3.hpp"
+
+
+/** Write the statistics in @c timing to @c out, one value or histogram on
+    each line, like this:
+
+    @verbatim
+    cycles 5625
+    events 812
+    dropped 0
+    late 0
+    maxlatency 0
+    nframes 256 256
+    offsets 12 3 4 9 21 40 95 201 427 0 0 0 0 0 0 0
+    notelatency 406 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0
+    @endverbatim
+
+    The histograms have the buckets described for MidiTiming. */
+void print_midi_timing(const MidiTiming& timing, std::ostream& out);
+
+
+/** Render notes with the engine at known frames, once in a single cycle
+    and then with different numbers of frames per cycle, and find the
+    frame where each note becomes audible. The notes must start at the
+    same frame relative to their events for all cycle sizes. Writes a
+    report to @c out and returns false if any note is off by 1 ms or more,
+    or if an event was dropped or handled late. */
+bool run_timing_test(std::ostream& out);
+
+
+#endif
@@ -0,0 +1,299 @@
+/****************************************************************************
+
+    presetfile.cpp - Reading and writing preset files
+
+    Copyright (C) 2026 agent <agent@local>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as published
+    by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 01222-1307  USA
+
+****************************************************************************/
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <locale>
+#include <sstream>
+#include <vector>
+
+#include <locale.h>
+#include <stdint.h>
+
+#include "filewriter.hpp"
+#include "presetfile.hpp"
+
+
+using namespace std;
+
+
+namespace {
+
+  const int format_version = 2;
+
+  uint32_t crc32(const char* data, size_t size) {
+    static uint32_t table[256];
+    static bool initialised = false;
+    if (!initialised) {
+      for (uint32_t i = 0; i < 256; ++i) {
+	uint32_t c = i;
+	for (int k = 0; k < 8; ++k)
+	  c = (c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1);
+	table[i] = c;
+      }
+      initialised = true;
+    }
+    uint32_t crc = 0xFFFFFFFF;
+    for (size_t i = 0; i < size; ++i)
+      crc = table[(crc ^ (unsigned char)data[i]) & 0xFF] ^ (crc >> 8);
+    return crc ^ 0xFFFFFFFF;
+  }
+
+
+  /* Parse a number from a line, skipping leading blanks. Returns false if
+     there is no number or it is out of range. Unlike operator>> this
+     doesn't care about stream state and doesn't allocate. */
+  bool parse_long(const char*& p, long min, long max, long& value) {
+    char* end;
+    errno = 0;
+    value = strtol(p, &end, 10);
+    if (end == p || errno || value < min || value > max)
+      return false;
+    p = end;
+    return true;
+  }
+
+
+  /* The values are always written with a '.', but GTK sets LC_NUMERIC
+     from the environment and strtof() would want a ',' in some locales,
+     so they are parsed in the C locale. */
+  bool parse_value(const char*& p, float& value) {
+    static locale_t c_locale = newlocale(LC_ALL_MASK, "C", 0);
+    char* end;
+    value = strtof_l(p, &end, c_locale);
+    if (end == p || !isfinite(value))
+      return false;
+    p = end;
+    if (value < 0)
+      value = 0;
+    else if (value > 1)
+      value = 1;
+    return true;
+  }
+
+
+  // the rest of the line after one separating blank, without a CR
+  string parse_name(const char* p, const char* end) {
+    if (p < end && (*p == ' ' || *p == '\t'))
+      ++p;
+    if (end > p && end[-1] == '\r')
+      --end;
+    return string(p, end - p);
+  }
+
+
+  int load_old(const string& data, Preset* presets, string& error) {
+    const char* p = data.c_str();
+    const char* data_end = p + data.size();
+    int loaded = 0;
+    int skipped = 0;
+    int line_number = 0;
+    while (p < data_end) {
+      const char* end = strchr(p, '\n');
+      if (!end)
+	end = data_end;
+      ++line_number;
+      string line(p, end);
+      p = end + 1;
+      const char* q = line.c_str();
+      while (*q == ' ' || *q == '\t' || *q == '\r')
+	++q;
+      if (!*q)
+	continue;
+
+      // skip lines that don't make sense instead of giving up on the file
+      long number;
+      float values[kNumParams];
+      int i;
+      if (!parse_long(q, 0, 127, number)) {
+	cerr<<"Invalid program number on line "<<line_number<<endl;
+	++skipped;
+	continue;
+      }
+      for (i = 0; i < kNumParams; ++i) {
+	if (!parse_value(q, values[i]))
+	  break;
+      }
+      if (i < kNumParams) {
+	cerr<<"Missing values for program "<<number<<endl;
+	++skipped;
+	continue;
+      }
+      memcpy(presets[number].values, values, sizeof(values));
+      presets[number].name =
+	parse_name(q, line.c_str() + line.size());
+      presets[number].empty = false;
+      ++loaded;
+    }
+    if (!loaded && skipped) {
+      error = "No valid presets";
+      return -1;
+    }
+    return loaded;
+  }
+
+
+  int load_current(const string& data, Preset* presets, string& error) {
+
+    // the checksum line is the last one, and covers everything before it
+    string::size_type pos = data.rfind("\nchecksum ");
+    if (pos == string::npos) {
+      error = "The checksum is missing, the file may be truncated";
+      return -1;
+    }
+    unsigned long checksum = strtoul(data.c_str() + pos + 10, 0, 16);
+    if (checksum != crc32(data.data(), pos + 1)) {
+      error = "The checksum is wrong, the file is damaged";
+      return -1;
+    }
+
+    // read into a copy first so a bad line doesn't leave half the presets
+    // loaded
+    vector<Preset> result(presets, presets + 128);
+    vector<int> columns;
+    int loaded = 0;
+    const char* p = data.c_str();
+    const char* data_end = p + pos + 1;
+    while (p < data_end) {
+      const char* end = static_cast<const char*>(memchr(p, '\n',
+							data_end - p));
+      if (!end)
+	end = data_end;
+      string line(p, end);
+      p = end + 1;
+      istringstream iss(line);
+      string keyword;
+      iss>>keyword;
+
+      // which controls the columns are, unknown names are skipped
+      if (keyword == "controls") {
+	columns.clear();
+	string name;
+	while (iss>>name) {
+	  int index = -1;
+	  for (int i = 0; i < kNumParams; ++i) {
+	    if (name == control_symbols[i]) {
+	      index = i;
+	      break;
+	    }
+	  }
+	  columns.push_back(index);
+	}
+      }
+
+      else if (keyword == "program") {
+	const char* q = line.c_str() + 7;
+	long number;
+	if (!parse_long(q, 0, 127, number)) {
+	  error = "Invalid program number in '" + line.substr(0, 20) + "'";
+	  return -1;
+	}
+	// controls that the file doesn't have get their default values
+	Preset& preset = result[number];
+	copy(default_values, default_values + kNumParams, preset.values);
+	for (unsigned i = 0; i < columns.size(); ++i) {
+	  float value;
+	  if (!parse_value(q, value)) {
+	    ostringstream oss;
+	    oss<<"Missing values for program "<<number;
+	    error = oss.str();
+	    return -1;
+	  }
+	  if (columns[i] >= 0)
+	    preset.values[columns[i]] = value;
+	}
+	preset.name = parse_name(q, line.c_str() + line.size());
+	preset.empty = false;
+	++loaded;
+      }
+    }
+
+    copy(result.begin(), result.end(), presets);
+    return loaded;
+  }
+
+}
+
+
+int PresetFile::load(const string& file, Preset* presets, string& error) {
+
+  // a file that doesn't exist just doesn't have any presets
+  ifstream fin(file.c_str(), ios::binary);
+  if (!fin) {
+    if (errno == ENOENT)
+      return 0;
+    error = strerror(errno);
+    return -1;
+  }
+  ostringstream oss;
+  oss<<fin.rdbuf();
+  string data = oss.str();
+
+  if (data.compare(0, 13, "AZR3-PRESETS ") != 0)
+    return load_old(data, presets, error);
+
+  int version = atoi(data.c_str() + 13);
+  if (version > format_version) {
+    ostringstream msg;
+    msg<<"The file has format version "<<version
+       <<" but this version of AZR-3 only knows "<<format_version;
+    error = msg.str();
+    return -1;
+  }
+  return load_current(data, presets, error);
+}
+
+
+string PresetFile::to_text(const Preset* presets) {
+
+  ostringstream oss;
+  oss.imbue(std::locale::classic());
+  oss<<"AZR3-PRESETS "<<format_version<<"\n"
+     <<"controls";
+  for (int i = 0; i < kNumParams; ++i)
+    oss<<" "<<control_symbols[i];
+  oss<<"\n";
+  for (int i = 0; i < 128; ++i) {
+    if (presets[i].empty)
+      continue;
+    oss<<"program "<<i;
+    for (int p = 0; p < kNumParams; ++p)
+      oss<<" "<<presets[i].values[p];
+    oss<<" "<<presets[i].name<<"\n";
+  }
+  string data = oss.str();
+  char line[32];
+  snprintf(line, sizeof(line), "checksum %08x\n",
+	   (unsigned)crc32(data.data(), data.size()));
+  return data + line;
+}
+
+
+bool PresetFile::save(const string& file, const Preset* presets,
+		      string& error) {
+  return write_file_atomically(file, to_text(presets), error);
+}
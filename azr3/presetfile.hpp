@@ -0,0 +1,78 @@
+/****************************************************************************
+
+    presetfile.hpp - Reading and writing preset files
+
+    Copyright (C) 2026 agent <agent@local>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as published
+    by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 01222-1307  USA
+
+****************************************************************************/
+
+#ifndef PRESETFILE_HPP
+#define PRESETFILE_HPP
+
+#include <algorithm>
+#include <string>
+
+#include "globals.hpp"
+
+
+struct Preset {
+  Preset() : empty(true) {
+    std::copy(default_values, default_values + kNumParams, values);
+  }
+  std::string name;
+  float values[kNumParams];
+  bool empty;
+};
+
+
+/** Functions for the preset files. The current format starts with a
+    version line and a line that names the controls, so controls can be
+    added or reordered without breaking old files, and ends with a CRC-32
+    of everything before it so a file that was cut short or damaged is
+    never half loaded:
+
+    @verbatim
+    AZR3-PRESETS 2
+    controls mono click bender ...
+    program 0 0 0.93 0.2 ... muddy moods SPLIT
+    checksum 1c291ca3
+    @endverbatim
+
+    The old format, one line per preset with the number, 63 values and the
+    name, can still be read. */
+namespace PresetFile {
+
+  /** Read the presets in @c file into @c presets, which must have room for
+      128. Controls that the file doesn't have get their values from
+      default_values. Returns the number of presets that were read, 0 if
+      the file doesn't exist, or -1 and an error message in @c error if the
+      file is broken. Nothing is changed then. */
+  int load(const std::string& file, Preset* presets, std::string& error);
+
+  /** The file contents for the 128 presets in @c presets. */
+  std::string to_text(const Preset* presets);
+
+  /** Write the 128 presets in @c presets to @c file with
+      write_file_atomically(), so @c file always has either the old or the
+      new presets. Returns false and an error message in @c error if the
+      file could not be written. */
+  bool save(const std::string& file, const Preset* presets,
+	    std::string& error);
+
+}
+
+
+#endif
@@ -0,0 +1,75 @@
+/****************************************************************************
+
+    ringbuffer.hpp - A lock-free queue for one reader and one writer
+
+    Copyright (C) 2026 agent <agent@local>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as published
+    by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 01222-1307  USA
+
+****************************************************************************/
+
+#ifndef RINGBUFFER_HPP
+#define RINGBUFFER_HPP
+
+
+/** A fixed size FIFO that one thread can write to and another thread can
+    read from without locks, so the writer can be the audio thread. Each
+    side only writes its own counter and the barriers make sure that an
+    element is complete before the reader sees it. @c N must be a power
+    of two so the counters can wrap around. */
+template <class T, unsigned N>
+class ringbuffer {
+public:
+
+  ringbuffer()
+    : m_read(0),
+      m_write(0) {
+
+  }
+
+  /** Add an element. Returns false without blocking if the buffer is
+      full. Only call this from the writer thread. */
+  bool push(const T& value) {
+    unsigned w = m_write;
+    if (w - m_read == N)
+      return false;
+    m_data[w & (N - 1)] = value;
+    __sync_synchronize();
+    m_write = w + 1;
+    return true;
+  }
+
+  /** Remove the oldest element. Returns false if the buffer is empty. Only
+      call this from the reader thread. */
+  bool pop(T& value) {
+    unsigned r = m_read;
+    if (r == m_write)
+      return false;
+    __sync_synchronize();
+    value = m_data[r & (N - 1)];
+    __sync_synchronize();
+    m_read = r + 1;
+    return true;
+  }
+
+protected:
+
+  T m_data[N];
+  volatile unsigned m_read;
+  volatile unsigned m_write;
+
+};
+
+
+#endif
@@ -0,0 +1,312 @@
+/****************************************************************************
+
+    rotor.cpp - A physically modelled rotary speaker cabinet
+
+    Copyright (C) 2026 agent <agent@local>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as published
+    by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 01222-1307  USA
+
+****************************************************************************/
+
+#include <cmath>
+
+#include "rotor.hpp"
+
+
+using namespace std;
+
+
+namespace {
+
+  // the cabinet, in metres
+  const float speed_of_sound = 343;
+  const float rotor_radius[2] = { 0.15f, 0.19f };	// horn, drum
+  const float mic_distance = 0.5f;
+  const float reflection_distance = 0.6f;	// extra path via the back wall
+  const float reflection_gain = 0.35f;
+
+  // amplitude modulation depth, and the directional lowpass cutoffs for the
+  // rotor pointing at the mic and away from it
+  const float am_depth[2] = { 0.5f, 0.35f };
+  const float front_cutoff[2] = { 14000, 3000 };
+  const float back_cutoff[2] = { 2500, 400 };
+
+  const float crossover = 800;
+  const float output_level = 0.58f;
+
+
+  float lowpass_coefficient(float cutoff, float samplerate) {
+    if (cutoff > 0.45f * samplerate)
+      cutoff = 0.45f * samplerate;
+    return 1 - exp(-2 * M_PI * cutoff / samplerate);
+  }
+
+}
+
+
+rotor_motor::rotor_motor(float samplerate)
+  : m_samplerate(samplerate),
+    m_up(-1),
+    m_down(-1),
+    m_k_up(1),
+    m_k_down(1),
+    m_speed(0) {
+
+}
+
+
+void rotor_motor::set_times(float up, float down) {
+  if (up != m_up) {
+    m_up = up;
+    m_k_up = 1 - exp(-ROTORBLOCK / (up * m_samplerate));
+  }
+  if (down != m_down) {
+    m_down = down;
+    m_k_down = 1 - exp(-ROTORBLOCK / (down * m_samplerate));
+  }
+}
+
+
+rotary::rotary(float samplerate)
+  : m_samplerate(samplerate),
+    m_quality(ROTOR_CLASSIC),
+    m_count(0),
+    m_writep(0),
+    m_spread(-1),
+    m_mic_c(1),
+    m_mic_s(0) {
+
+  float scale = m_samplerate / speed_of_sound;
+  for (int r = 0; r < 2; ++r) {
+    m_base[r] = mic_distance * scale;
+    m_depth[r] = rotor_radius[r] * scale;
+    m_am[r] = am_depth[r];
+    m_k_front[r] = lowpass_coefficient(front_cutoff[r], m_samplerate);
+    m_k_back[r] = lowpass_coefficient(back_cutoff[r], m_samplerate);
+    m_c[r] = 1;
+    m_s[r] = 0;
+    m_speed[r] = 0;
+  }
+  m_reflection = reflection_distance * scale;
+
+  // the longest delay is the horn reflection from the far side, and the
+  // cubic interpolation reads two samples around that
+  int longest = int(m_base[0] + m_depth[0] + m_reflection) + 3;
+  if (m_base[1] + m_depth[1] + 3 > longest)
+    longest = int(m_base[1] + m_depth[1]) + 3;
+  int size = 1;
+  while (size < longest)
+    size <<= 1;
+  m_mask = size - 1;
+  m_buffer[0] = new float[size];
+  m_buffer[1] = new float[size];
+
+  m_split.setparam(crossover, 1.4f, m_samplerate);
+
+  set_quality(ROTOR_CLASSIC);
+  reset();
+}
+
+
+rotary::~rotary() {
+  delete [] m_buffer[0];
+  delete [] m_buffer[1];
+}
+
+
+void rotary::set_quality(int quality) {
+  if (quality < ROTOR_CLASSIC || quality > ROTOR_HIGH)
+    quality = ROTOR_STANDARD;
+  m_quality = quality;
+  m_cubic[0] = m_filter[0] = (quality >= ROTOR_STANDARD);
+  m_cubic[1] = m_filter[1] = m_reflect = (quality >= ROTOR_HIGH);
+}
+
+
+int rotary::parse_quality(const string& name) {
+  if (name == "classic")
+    return ROTOR_CLASSIC;
+  if (name == "eco")
+    return ROTOR_ECO;
+  if (name == "standard")
+    return ROTOR_STANDARD;
+  if (name == "high")
+    return ROTOR_HIGH;
+  return -1;
+}
+
+
+void rotary::set_speeds(float horn, float drum) {
+  m_speed[0] = horn;
+  m_speed[1] = drum;
+}
+
+
+void rotary::set_spread(float spread) {
+  if (spread == m_spread)
+    return;
+  m_spread = spread;
+  float angle = spread * M_PI / 2;
+  m_mic_c = cos(angle);
+  m_mic_s = sin(angle);
+}
+
+
+void rotary::reset() {
+  for (int i = 0; i <= m_mask; ++i)
+    m_buffer[0][i] = m_buffer[1][i] = 0;
+  m_split.set_samplerate(m_samplerate);
+  for (int r = 0; r < 2; ++r) {
+    for (int m = 0; m < 2; ++m) {
+      tap& t = m_taps[r][m];
+      t.delay = m_base[r];
+      t.gain = 1;
+      t.k = m_k_front[r];
+      t.ddelay = t.dgain = t.dk = t.lp = 0;
+    }
+  }
+  for (int m = 0; m < 2; ++m) {
+    m_back[m] = m_taps[0][m];
+    m_back[m].delay += m_reflection;
+  }
+  m_count = 0;
+}
+
+
+void rotary::set_target(tap& t, float delay, float gain, float k) {
+  t.ddelay = (delay - t.delay) * (1.0f / ROTORBLOCK);
+  t.dgain = (gain - t.gain) * (1.0f / ROTORBLOCK);
+  t.dk = (k - t.k) * (1.0f / ROTORBLOCK);
+  t.lp = DENORMALIZE(t.lp);
+}
+
+
+/*
+  Turn the rotors one block further and compute where all the modulation
+  should be at the end of the next block. The rotors are unit phasors that
+  are multiplied with the rotation for one block. The angles are tiny so
+  a few Taylor terms are exact enough for sin and cos, and the phasor is
+  pulled back to length 1 every time so the errors don't add up.
+*/
+void rotary::control() {
+  for (int r = 0; r < 2; ++r) {
+
+    // the horn and the drum turn in opposite directions
+    float a = 2 * M_PI * ROTORBLOCK * m_speed[r] / m_samplerate;
+    if (r == 1)
+      a = -a;
+    float a2 = a * a;
+    float ca = 1 - a2 / 2 + a2 * a2 / 24;
+    float sa = a * (1 - a2 / 6 + a2 * a2 / 120);
+    float c = m_c[r] * ca - m_s[r] * sa;
+    float s = m_c[r] * sa + m_s[r] * ca;
+    float n = 1.5f - 0.5f * (c * c + s * s);
+    m_c[r] = c * n;
+    m_s[r] = s * n;
+
+    // mic 0 is on the left, at -spread, and mic 1 on the right
+    for (int m = 0; m < 2; ++m) {
+      float mic_s = (m == 0 ? -m_mic_s : m_mic_s);
+      float cr = m_c[r] * m_mic_c + m_s[r] * mic_s;	// 1 = pointing at mic
+      float front = 0.5f + 0.5f * cr;
+      set_target(m_taps[r][m], m_base[r] - m_depth[r] * cr,
+		 1 + m_am[r] * cr,
+		 m_k_back[r] + (m_k_front[r] - m_k_back[r]) * front);
+
+      // the horn reflection is loudest when the horn points away
+      if (r == 0 && m_reflect) {
+	set_target(m_back[m], m_base[r] + m_depth[r] * cr + m_reflection,
+		   reflection_gain * (1 - m_am[r] * cr),
+		   m_k_front[r] + (m_k_back[r] - m_k_front[r]) * front);
+      }
+    }
+  }
+}
+
+
+float rotary::read_linear(const float* buf, float delay) const {
+  float pos = m_writep + m_mask + 1 - delay;
+  int ip = int(pos);
+  float f = pos - ip;
+  float y0 = buf[ip & m_mask];
+  float y1 = buf[(ip + 1) & m_mask];
+  return y0 + f * (y1 - y0);
+}
+
+
+float rotary::read_cubic(const float* buf, float delay) const {
+  float pos = m_writep + m_mask + 1 - delay;
+  int ip = int(pos);
+  float f = pos - ip;
+  float ym1 = buf[(ip - 1) & m_mask];
+  float y0 = buf[ip & m_mask];
+  float y1 = buf[(ip + 1) & m_mask];
+  float y2 = buf[(ip + 2) & m_mask];
+  float c1 = 0.5f * (y1 - ym1);
+  float c2 = ym1 - 2.5f * y0 + 2 * y1 - 0.5f * y2;
+  float c3 = 0.5f * (y2 - ym1) + 1.5f * (y0 - y1);
+  return ((c3 * f + c2) * f + c1) * f + y0;
+}
+
+
+void rotary::clock(float input, float& left, float& right) {
+  if (m_quality == ROTOR_CLASSIC) {
+    left = right = 0;
+    return;
+  }
+
+  if (m_count == 0)
+    control();
+  if (++m_count == ROTORBLOCK)
+    m_count = 0;
+
+  m_split.clock(input);
+  m_writep = (m_writep + 1) & m_mask;
+  m_buffer[0][m_writep] = m_split.hp();
+  m_buffer[1][m_writep] = m_split.lp();
+
+  float out[2] = { 0, 0 };
+  for (int r = 0; r < 2; ++r) {
+    for (int m = 0; m < 2; ++m) {
+      tap& t = m_taps[r][m];
+      float y;
+      if (m_cubic[r])
+	y = read_cubic(m_buffer[r], t.delay);
+      else
+	y = read_linear(m_buffer[r], t.delay);
+      if (m_filter[r]) {
+	t.lp += t.k * (y - t.lp);
+	y = t.lp;
+	t.k += t.dk;
+      }
+      out[m] += t.gain * y;
+      t.delay += t.ddelay;
+      t.gain += t.dgain;
+    }
+  }
+
+  if (m_reflect) {
+    for (int m = 0; m < 2; ++m) {
+      tap& t = m_back[m];
+      t.lp += t.k * (read_cubic(m_buffer[0], t.delay) - t.lp);
+      out[m] += t.gain * t.lp;
+      t.delay += t.ddelay;
+      t.gain += t.dgain;
+      t.k += t.dk;
+    }
+  }
+
+  left = out[0] * output_level;
+  right = out[1] * output_level;
+}
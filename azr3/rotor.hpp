@@ -0,0 +1,178 @@
+/****************************************************************************
+
+    rotor.hpp - A physically modelled rotary speaker cabinet
+
+    Copyright (C) 2026 agent <agent@local>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as published
+    by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 01222-1307  USA
+
+****************************************************************************/
+
+#ifndef ROTOR_HPP
+#define ROTOR_HPP
+
+#include <string>
+
+#include "filters.hpp"
+
+
+// rotary speaker qualities (rotary::set_quality())
+
+#define	ROTOR_CLASSIC	0	// the original Leslie code in AZR3::process()
+#define	ROTOR_ECO		1
+#define	ROTOR_STANDARD	2
+#define	ROTOR_HIGH		3
+
+// the rotor angles and modulation targets are updated this often
+#define	ROTORBLOCK		16
+
+
+/** The speed of a rotor with inertia. The speed approaches the motor speed
+    exponentially, with different time constants for speeding up and
+    slowing down, and it is integrated once per ROTORBLOCK samples. The
+    speed only ever changes a little per block, so everything that is
+    driven by it (the rotor angles, the LFOs of the classic Leslie) moves
+    smoothly and keeps its phase. */
+class rotor_motor {
+public:
+
+  rotor_motor(float samplerate);
+
+  /** Set the time constants in seconds. The coefficients are only
+      recomputed when the times change. */
+  void set_times(float up, float down);
+
+  /** Integrate one control block towards @c target (rotations per second)
+      and return the new speed. */
+  float step(float target) {
+    m_speed += (target > m_speed ? m_k_up : m_k_down) * (target - m_speed);
+    return m_speed;
+  }
+
+private:
+
+  float m_samplerate;
+  float m_up, m_down;
+  float m_k_up, m_k_down;
+  float m_speed;
+
+};
+
+
+/** A rotary speaker cabinet modelled from its geometry. The signal is split
+    into a horn and a drum part. Each rotor writes into its own delay line
+    and each of the two microphones reads from it at a distance that
+    follows the rotor angle (doppler), with a gain that follows the angle
+    (the rotor points towards or away from the mic) and, depending on the
+    quality, through a lowpass that follows the angle (the horn sounds dull
+    from behind). In the highest quality the sound that the horn throws
+    at the back of the cabinet is added as a second, later path. The
+    angles and all modulation targets are computed every ROTORBLOCK
+    samples and ramped linearly in between, so there are no trig calls
+    in the audio loop.
+
+    The qualities, from the cheapest to the most expensive. The classic
+    Leslie in AZR3::process() is used when none of them is chosen:
+
+    ROTOR_ECO      - linear interpolation, amplitude modulation, no
+                     directional filters.
+    ROTOR_STANDARD - cubic interpolation and a directional filter for the
+                     horn.
+    ROTOR_HIGH     - cubic interpolation and directional filters for both
+                     rotors, and the cabinet reflections of the horn.
+*/
+class rotary {
+public:
+
+  rotary(float samplerate);
+  ~rotary();
+
+  /** Set the quality, one of the ROTOR_ constants. ROTOR_CLASSIC is
+      accepted but makes clock() output silence, the caller is expected to
+      use its own code in that case. */
+  void set_quality(int quality);
+  int get_quality() const { return m_quality; }
+
+  /** Parse a quality name ("classic", "eco", "standard", "high"). Returns
+      -1 if the name isn't known. */
+  static int parse_quality(const std::string& name);
+
+  /** Set the rotor speeds in rotations per second. */
+  void set_speeds(float horn, float drum);
+
+  /** Set the microphone placement from 0 (both mics at the front, almost
+      mono) to 1 (the mics on opposite sides of the cabinet). This only
+      does work when the value changes. */
+  void set_spread(float spread);
+
+  /** Clear the delay lines and filters. */
+  void reset();
+
+  /** Process a single sample. */
+  void clock(float input, float& left, float& right);
+
+private:
+
+  /** One path from a rotor to a microphone. */
+  struct tap {
+    float delay, ddelay;	// delay in samples and its increment per sample
+    float gain, dgain;
+    float k, dk;			// lowpass coefficient
+    float lp;				// lowpass state
+  };
+
+  void control();
+  void set_target(tap& t, float delay, float gain, float k);
+  inline float read_linear(const float* buf, float delay) const;
+  inline float read_cubic(const float* buf, float delay) const;
+
+  float m_samplerate;
+  int m_quality;
+  int m_count;
+
+  filt1 m_split;
+
+  // delay lines for the horn (0) and the drum (1)
+  float* m_buffer[2];
+  int m_mask;
+  int m_writep;
+
+  // rotor angles as unit phasors, and their speeds
+  float m_c[2], m_s[2];
+  float m_speed[2];
+
+  // microphone angles
+  float m_spread;
+  float m_mic_c, m_mic_s;
+
+  // geometry, in samples, and modulation depths
+  float m_base[2];
+  float m_depth[2];
+  float m_reflection;
+  float m_am[2];
+  float m_k_front[2], m_k_back[2];
+
+  // [rotor][mic], and the horn reflections for each mic
+  tap m_taps[2][2];
+  tap m_back[2];
+
+  // quality dependent switches
+  bool m_cubic[2];
+  bool m_filter[2];
+  bool m_reflect;
+
+};
+
+
+#endif
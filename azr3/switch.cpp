@@ -33,6 +33,7 @@ using namespace std;
 
 Switch::Switch(Type type) 
   : m_adj(0, 0, 1),
+    m_shown_on(false),
     m_type(type) {
 
   if (m_type == BigRed) {
@@ -49,7 +50,12 @@ Switch::Switch(Type type)
   }
   set_size_request(m_width, m_height);
   add_events(EXPOSURE_MASK | BUTTON_PRESS_MASK | SCROLL_MASK);
-  m_adj.signal_value_changed().connect(mem_fun(*this, &Switch::queue_draw));
+  m_adj.signal_value_changed().connect(mem_fun(*this, &Switch::value_changed));
+}
+
+
+Switch::~Switch() {
+  AZR3GUI::cancel_redraw(this);
 }
  
  
@@ -73,20 +79,27 @@ void Switch::on_realize() {
   else if (m_type == Mini)
     filename = DATADIR "/minioffon.png";
   m_pixmap = AZR3GUI::pixmap_from_file(filename);
+  m_gc = GC::create(get_window());
 }
 
 
 bool Switch::on_expose_event(GdkEventExpose* event) {
   RefPtr<Gdk::Window> win = get_window();
-  RefPtr<GC> gc = GC::create(win);
+  m_shown_on = (m_adj.get_value() > 0.5);
   int yoffset = 0;
-  if (m_adj.get_value() > 0.5)
+  if (m_shown_on)
     yoffset = m_height;
-  win->draw_drawable(gc, m_pixmap, 0, yoffset, 0, 0, m_width, m_height);
+  win->draw_drawable(m_gc, m_pixmap, 0, yoffset, 0, 0, m_width, m_height);
   return true;
 }
 
 
+void Switch::value_changed() {
+  if ((m_adj.get_value() > 0.5) != m_shown_on)
+    AZR3GUI::queue_redraw(this);
+}
+
+
 bool Switch::on_button_press_event(GdkEventButton* event) {
   m_adj.set_value(m_adj.get_value() < 0.5 ? 1 : 0);
   return true;
@@ -37,6 +37,8 @@ public:
   
   Switch(Type type);
   
+  ~Switch();
+  
   void set_value(float value);
   
   Gtk::Adjustment& get_adjustment();
@@ -47,9 +49,14 @@ protected:
   bool on_expose_event(GdkEventExpose* event);
   bool on_button_press_event(GdkEventButton* event);
   bool on_scroll_event(GdkEventScroll* event);
+  
+  /** Queue a redraw if the switch has been flipped. */
+  void value_changed();
 
   Gtk::Adjustment m_adj;
   Glib::RefPtr<Gdk::Pixmap> m_pixmap;
+  Glib::RefPtr<Gdk::GC> m_gc;
+  bool m_shown_on;
   int m_width;
   int m_height;
   Type m_type;
@@ -40,8 +40,10 @@
   meter goes down if you use less voices...
 */
 #include "voice_classes.hpp"
+#include "globals.hpp"
 #include <math.h>
-#include <limits>
+#include <string.h>
+#include <pthread.h>
 #ifdef WIN32
 #include <wtypes.h>
 #endif
@@ -53,24 +55,239 @@
 using namespace std;
 
 
+const float voicetables::perc_multipliers[NUMOFPERCMULTS] = 
+  { 0, 1, 2, 3, 4, 6, 8, 10, 12, 16 };
+
+
+voicetables::voicetables(float samplerate) 
+  : samplerate(samplerate),
+    next(0) {
+  /*
+    This "scaler" stuff is important to keep timing independant from
+    the actual samplerate.
+  */
+  float	scaler = samplerate / 44100;
+  
+  double k = 1.059463094359;	// 12th root of 2
+  double a = 6.875;	// a
+  a *= k;	// b
+  a *= k;	// bb
+  a *= k;	// c, frequency of midi note 0
+  for (int i = 0; i < 128; i++) {
+    freq[i] = (float)a;
+    cycles[i] = (float)(a / samplerate);
+    a *= k;
+  }
+  
+  // fast sine calculation, precise enough for our percussion effect
+  for (int m = 0; m < NUMOFPERCMULTS; m++) {
+    for (int i = 0; i < 128; i++) {
+      float	fact = perc_multipliers[m] * freq[i];
+      while(fact>3800)
+	fact *= .5f;
+      perc_coeff[m][i] = 2 * sinf(3.14159265358979f * fact / samplerate);
+    }
+  }
+  
+  click_attack = .004f / scaler;
+  attack = .05f / scaler;
+  fast_release = .03f / scaler;
+  release = (float)pow(.90197, 1.0 / scaler);
+  release_scale = 1 / scaler;
+  for (int n = 0; n <= ENVBLOCKSIZE; n++)
+    release_pow[n] = (float)pow(release, n / 6.0);
+  perc_decay = .00035f * 3 / scaler;
+}
+
+
+const voicetables* voicetables::get(float samplerate) {
+  static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+  static const voicetables* first = 0;
+  
+  pthread_mutex_lock(&lock);
+  const voicetables* t;
+  for (t = first; t != 0; t = t->next) {
+    if (t->samplerate == samplerate)
+      break;
+  }
+  if (t == 0) {
+    voicetables* nt = new voicetables(samplerate);
+    nt->next = first;
+    first = t = nt;
+  }
+  pthread_mutex_unlock(&lock);
+  
+  return t;
+}
+
+
+int voicetables::perc_index(float perc_multiplier) {
+  for (int m = 0; m < NUMOFPERCMULTS; m++) {
+    if (perc_multipliers[m] >= perc_multiplier)
+      return m;
+  }
+  return NUMOFPERCMULTS - 1;
+}
+
+
+percbank::percbank() {
+  reset();
+}
+
+
+void percbank::reset() {
+  numactive = 0;
+  for (int v = 0; v <= MAXVOICES; v++) {
+    slot[v] = -1;
+    vchan[v] = 0;
+  }
+}
+
+
+void percbank::set_channel(int v, int channel) {
+  vchan[v] = channel;
+}
+
+
+void percbank::trigger(int v, float a, float volume, float attack, 
+		       float decay, float fast_release) {
+  int k = slot[v];
+  if (k < 0) {
+    k = numactive++;
+    slot[v] = k;
+    owner[k] = v;
+  }
+  chan[k] = vchan[v];
+  phase[k] = 1;
+  this->a[k] = a;
+  s0[k] = .5f;
+  s1[k] = 0;
+  vca[k] = 0;
+  vol[k] = volume;
+  this->attack[k] = attack;
+  this->decay[k] = decay;
+  this->fast_release[k] = fast_release;
+}
+
+
+void percbank::release(int v) {
+  if (slot[v] >= 0)
+    phase[slot[v]] = 3;
+}
+
+
+/*
+  Move the last active generator into slot k so the active ones stay
+  packed at the front.
+*/
+void percbank::remove(int k) {
+  int last = --numactive;
+  slot[owner[k]] = -1;
+  if (k == last)
+    return;
+  owner[k] = owner[last];
+  slot[owner[k]] = k;
+  chan[k] = chan[last];
+  phase[k] = phase[last];
+  a[k] = a[last];
+  s0[k] = s0[last];
+  s1[k] = s1[last];
+  vca[k] = vca[last];
+  vol[k] = vol[last];
+  attack[k] = attack[last];
+  decay[k] = decay[last];
+  fast_release[k] = fast_release[last];
+}
+
+
+/*
+  Same scheme as voice::render(): the envelopes are advanced once for the
+  block and ramped linearly. The inner loop runs over all active
+  generators for every sample, that loop has no dependencies between
+  iterations so the compiler can vectorise it.
+*/
+void percbank::render(float out[][ENVBLOCKSIZE], int nframes) {
+  if (numactive == 0)
+    return;
+  
+  const float	steps = nframes * (1.0f / 6);
+  float	pvca[MAXVOICES+1];
+  float	dvca[MAXVOICES+1];
+  float	x[MAXVOICES+1];
+  int		i, k;
+  
+  for (k = 0; k < numactive; k++) {
+    pvca[k] = vca[k];
+    
+    // percussion attack
+    if (phase[k] == 1) {
+      vca[k] += attack[k] * steps;
+      if (vca[k] >= 1)
+	phase[k] = 2;	// switch to percussion decay
+    }
+    
+    // percussion decay 
+    else if (phase[k] == 2) {
+      vca[k] -= decay[k] * steps;
+      if (vca[k] <= 0) {
+	vca[k] = 0;
+	phase[k] = 0;	// percussion finished
+      }
+    }
+    
+    // percussion fast release
+    else {
+      vca[k] -= fast_release[k] * steps;
+      if (vca[k] <= 0) {
+	vca[k] = 0;
+	phase[k] = 0;	// percussion finished
+      }
+    }
+    
+    dvca[k] = (vca[k] - pvca[k]) / nframes;
+  }
+  
+  for (i = 0; i < nframes; i++) {
+    for (k = 0; k < numactive; k++) {
+      s0[k] = s0[k] - a[k] * s1[k];	// calculate sine wave
+      s1[k] = s1[k] + a[k] * s0[k];	//
+      x[k] = vol[k] * s0[k] * pvca[k] * pvca[k];
+      pvca[k] += dvca[k];
+    }
+    for (k = 0; k < numactive; k++)
+      out[chan[k]][i] += x[k];
+  }
+  
+  // drop the finished ones
+  for (k = numactive - 1; k >= 0; k--) {
+    if (phase[k] == 0)
+      remove(k);
+  }
+}
+
+
 void voice::reset() {
   actual_note = -1;
   next_note = -1;
   perc_next_note = -1;
   perc_ok = false;
   vca_phase = VP_IDLE;
-  output = 0;
   VCA = 0;
+  onset = -1;
+  onset_done = false;
   perc = 0;
-  perc_vca = 0;
   percmultiplier = 0;
-  adsr_decay = 0;
+  percindex = 0;
   click = 0;
   status = VS_IDLE;
   pedal = false;
   pitch = 1;
   phase = phaseinc = 0;
   sustain = 0;
+  my_chain = my_table = 0;
+  my_chain_size = my_size = 0;
+  fade_offset = 0;
+  fade = fade_step = 0;
 }
 
 
@@ -79,9 +296,7 @@ void voice::suspend() {
   next_note = -1;
   perc_next_note = -1;
   vca_phase = VP_IDLE;
-  output = 0;
   VCA = 0;
-  perc_vca = 0;
   status = VS_IDLE;
   pitch = 1;
   phase = phaseinc = 0;
@@ -94,248 +309,302 @@ void voice::resume() {
 
 
 voice::voice() {
-  midi_scaler = (1. / 127.);
-
-  long i;
-
-  double k = 1.059463094359;	// 12th root of 2
-  double a = 6.875;	// a
-  a *= k;	// b
-  a *= k;	// bb
-  a *= k;	// c, frequency of midi note 0
-  for (i = 0; i  <  128; i++) {
-    freqtab[i] = (float)a;
-    a *= k;
-  }
-  samplecount1 = samplecount2 = 0;
+  tables = voicetables::get(44100);
+  set_seed(22222);
   sustain = 0;
   perc_ok = false;
+  pbank = 0;
+  pindex = 0;
+}
+
+
+void voice::set_percbank(percbank* bank, int index) {
+  pbank = bank;
+  pindex = index;
+}
+
+
+void voice::perc_trigger() {
+  if (perc_ok && perc > 0 && percmultiplier > 0)
+    pbank->trigger(pindex, perc_a, perc, adsr_attack, perc_decay, 
+		   adsr_fast_release);
+}
+
+
+void voice::set_seed(uint32_t seed) {
+  // xorshift gets stuck at 0
+  randseed = (seed != 0 ? seed : 22222);
+}
+
+
+/*
+  A xorshift generator for the click noise. Every voice has its own so
+  several voices (and several engines in the same process) don't share
+  any state, and the output only depends on the seed.
+*/
+float voice::random() {
+  randseed ^= randseed << 13;
+  randseed ^= randseed >> 17;
+  randseed ^= randseed << 5;
+  return (randseed >> 8) * (1.0f / 16777216);
 }
 
 
 void voice::set_samplerate(float samplerate) {
-  this->samplerate = samplerate;
+  tables = voicetables::get(samplerate);
   clicklp.set_samplerate(samplerate);
 }
 
 void voice::voicecalc() {
   /*
-    This "scaler" stuff is important to keep timing independant from
-    the actual samplerate.
+    All the samplerate dependent constants are precomputed in the shared
+    voicetables, so this is just a few lookups unless the pitch is bent.
   */
-  float	scaler;
-  scaler = samplerate / 44100;
-
-  clickattack = .004f / scaler;
-  adsr_attack = .05f / scaler;
+  clickattack = tables->click_attack;
+  adsr_attack = tables->attack;
 
-  adsr_decay = 0 / scaler;
   if (sustain > 0)
-    adsr_release = (.0001f + .0005f * (1 - sustain)) / scaler;
+    adsr_release = (.0001f + .0005f * (1 - sustain)) * tables->release_scale;
   else
-    adsr_release = pow(.90197, 1.0 / scaler);
+    adsr_release = tables->release;
 
-  adsr_fast_release = .03f / scaler;
+  adsr_fast_release = tables->fast_release;
 	
-  perc_decay = perc_fade * .00035f / scaler;
+  perc_decay = perc_fade * tables->perc_decay;
 
-  perc_decay *= 3;
-
-  samplerate_scaler = (float)((double)my_size / (double)samplerate);
-  phaseinc = (float)freqtab[actual_note] * samplerate_scaler * pitch;
-  if (perc_phase == 0) {
-    // fast sine calculation, precise enough for our percussion effect
-    float	fact = percmultiplier * freqtab[actual_note];
+  if (actual_note < 0)
+    return;
+  
+  /*
+    Choose the largest mip level that we can play without aliasing, i.e.
+    the one where we move at most MIPOVERSAMPLING samples per output
+    sample. If we switch levels while playing (pitch bend) a floating
+    point phase has to be scaled too.
+  */
+  float	cycles = tables->cycles[actual_note] * pitch;
+  volatile float* table = my_chain;
+  long	size = my_chain_size;
+  for (int m = 1; m < WAVETABLEMIPS && cycles * size > MIPOVERSAMPLING; 
+       m++) {
+    table += size + 1;
+    size >>= 1;
+  }
+  my_table = table;
+#if FIXEDPHASE
+  my_size = size;
+  phaseinc = (uint32_t)(int64_t)(cycles * 4294967296.0);
+  for (phaseshift = 32; size > 1; size >>= 1)
+    phaseshift--;
+  fractmask = (1UL << phaseshift) - 1;
+  fractscale = 1.0f / (fractmask + 1.0f);
+#else
+  if (size != my_size && my_size > 0)
+    phase = phase * size / my_size;
+  my_size = size;
+  phaseinc = cycles * size;
+#endif
+  
+  // the percussion picks this up when it is triggered
+  if (pitch == 1)
+    perc_a = tables->perc_coeff[percindex][actual_note];
+  else {
+    float	fact = percmultiplier * tables->freq[actual_note];
     while(fact>3800)
       fact *= .5f;
-    a = 2 * sinf(3.14159265358979f * pitch * fact / samplerate);
-    s0 = .5f;
-    s1 = 0;
+    perc_a = 2 * sinf(3.14159265358979f * pitch * fact / tables->samplerate);
   }
 }
 
 
-float voice::clock() {
-  if (status == VS_IDLE||actual_note < 0)	// nothing to do...
-    return(0);
-
-  output = 0;
+/*
+  Read one sample from the current mip level and advance the phase. We use
+  a very simple interpolation to determine the actual sample value. The
+  anti-aliasing is taken care of by choosing the right mip level in
+  voicecalc().
+*/
+inline float voice::wave() {
+#if FIXEDPHASE
   /*
-    This is the part where we read a value from the assigned wavetable.
-    We use a very simple interpolation to determine the actual sample
-    value. Since we use almost pure sine waves we don't have to take care
-    about anti-aliasing here. The few aliasing effects we receive sound just
-    like those real hardware tonewheels...
+    The phase is a 32 bit fraction of a full period, so the integer
+    overflow wraps it around for free and the top bits are the table index.
+    Every mip level has a guard sample at the end so we can always read
+    iphase+1.
   */
-  iphase = int(phase);
-  fract = phase-iphase;
-  y0 = my_table[iphase];
-  y1 = my_table[iphase+1];
-  output = (y0+fract * (y1-y0)) * VCA;
+  unsigned long iphase = phase >> phaseshift;
+  float fract = (phase & fractmask) * fractscale;
+  float y0 = my_table[iphase];
+  float y1 = my_table[iphase+1];
+  phase  +=  phaseinc;
+#else
+  int iphase = int(phase);
+  float fract = phase-iphase;
+  float y0 = my_table[iphase];
+  float y1 = my_table[iphase+1];
 
   phase  +=  phaseinc;
 
   /*
     No, we don't use the bit mask stuff as mentioned in the SDK.
     It's _not_ slower this way, and we can have random wavetable sizes.
+    Every mip level has a guard sample at the end, so we only need to
+    wrap when we reach the end of the table.
   */
-  if (phase>my_size)
+  if (phase>=my_size)
     phase -= my_size;
-
-  samplecount1++;
+#endif
+  if (fade <= 0)
+    return y0+fract * (y1-y0);
   
-  // do envelope stuff every 5 samples
-  if (samplecount1 > 5) {
-    samplecount1 = 0;
-      
-    // attack - gradually increase the envelope to 1
-    if (vca_phase == VP_A) {
-      if (click <= 0) {
-	VCA += adsr_attack;
-      }
+  // the tables have been switched, read the same position from the old
+  // ones and mix them in
+  volatile float* old = my_table - fade_offset;
+  float y = y0+fract * (y1-y0);
+  float o = old[iphase]+fract * (old[iphase+1]-old[iphase]);
+  fade -= fade_step;
+  return y + (fade > 0 ? fade : 0) * (o-y);
+}
+
+
+/*
+  Render nframes samples (at most ENVBLOCKSIZE) and add them to out.
+  The envelopes run at control rate: the state machine is advanced once
+  for the whole block and the VCA is ramped linearly to its new value, so
+  the sample loops don't branch. The percussion is rendered separately by
+  the percbank. The
+  envelope constants are per 6 samples, that used to be the envelope
+  update interval.
+*/
+void voice::render(float* out, int nframes) {
+  if (status == VS_IDLE||actual_note < 0)	// nothing to do...
+    return;
 
+  const float	steps = nframes * (1.0f / 6);
+  const float	vca_start = VCA;
+  bool	done = false;		// the envelope reaches 0 in this block
+  int		i;
+  
+  // attack - gradually increase the envelope to 1. If click is on VCA is
+  // increased per sample in the click loop instead.
+  if (vca_phase == VP_A) {
+    if (click <= 0) {
+      VCA += adsr_attack * steps;
       if (VCA > 1) {
 	VCA = 1;
 	vca_phase = VP_D;
       }
     }
+  }
+  
+  // decay - just skip to sustain immediately
+  else if (vca_phase == VP_D) {
+    vca_phase = VP_S;
+  }
+  
+  // release - gradually decrease the envelope to 0
+  else if (vca_phase == VP_R) {
     
-    // decay - just skip to sustain immediately
-    else if (vca_phase == VP_D) {
-      vca_phase = VP_S;
+    // turn off the percussion sound
+    if (perc > 0) {
+      if (sustain == 0)
+	pbank->release(pindex);
     }
     
-    // sustain - just wait for the key release
-    else if (vca_phase == VP_S) {
-      // output *= adsr_sustain;
-    }
+    // decrease the envelope
+    if (sustain > 0)
+      VCA -= adsr_release * steps;
+    else
+      VCA *= tables->release_pow[nframes];
     
-    // release - gradually decrease the envelope to 0
-    else if (vca_phase == VP_R) {
-      
-      // turn off the percussion sound
-      if (perc > 0) {
-	if (sustain == 0)
-	  perc_phase = 3;
-      }
-      
-      // decrease the envelope
-      if (sustain > 0)
-	VCA -= adsr_release;
-      else
-	VCA *= adsr_release;
-      
-      // go to idle state if we have almost reached 0
-      if (VCA <= 0.00001f) {
-	VCA = 0;
-	actual_note = -1;
-	phase = 0;
-	vca_phase = VP_IDLE;
-	output = 0;
-	status = VS_IDLE;
-      }
+    // go to idle state if we have almost reached 0
+    if (VCA <= 0.00001f) {
+      VCA = 0;
+      done = true;
     }
-    
-    // fast release - turn everything off NOW
-    else if (vca_phase == VP_FR) {
-      
-      VCA -= adsr_fast_release;
-      
-      if (VCA <= 0) {
-	VCA = 0;
-	actual_note = -1;
-	if (next_note >= 0) {
-	  actual_note = next_note;
-	  next_note = -1;
-	  vca_phase = VP_A;
-	  phase = 0;
-	  perc_phase = 0;
-	  this->voicecalc();
-		  
-	  // retrigger percussion
-	  if (perc_ok && perc>0 && percmultiplier>0) {
-	    perc_phase = 1;
-	    perc_vca = 0;
-	  }
-	}
-	else
-	  status = VS_IDLE;
-      }
+  }
+  
+  // fast release - turn everything off NOW
+  else if (vca_phase == VP_FR) {
+    VCA -= adsr_fast_release * steps;
+    if (VCA <= 0) {
+      VCA = 0;
+      done = true;
     }
-    
   }
   
   // if we're in the attack state and click is on, generate a click
   if (vca_phase == VP_A && click > 0) {
-    static unsigned long randSeed = 22222;
-    float rand = 0;
-    float mattack = 0;
-    if (mattack < 1)
-      mattack = VCA * 8;
-    if (mattack>1)
-      mattack = 1;
-    randSeed = (randSeed * 196314165) + 907633515;
-    rand = (float)randSeed / std::numeric_limits<unsigned long>::max();
-    clicklp.clock(click * rand * .3f);
-    noise = clicklp.bp();
-    noise *= clickvol;
-    output = mattack * (2-VCA) * (output+noise);
-    VCA += clickattack;
+    for (i = 0; i < nframes; ++i) {
+      float mattack = VCA * 8;
+      if (mattack>1)
+	mattack = 1;
+      clicklp.clock(click * random() * .3f);
+      float noise = clicklp.bp() * clickvol;
+      out[i] += mattack * (2-VCA) * (wave() * VCA + noise);
+      VCA += clickattack;
+    }
+    if (VCA > 1) {
+      VCA = 1;
+      vca_phase = VP_D;
+    }
   }
-
+  
   // generate release click
-  if (vca_phase == VP_R && click > 0 && sustain == 0) {
-    static unsigned long randSeed = 22222;
-    float rand = 0;
-    randSeed = (randSeed * 196314165) + 907633515;
-    rand = (float)randSeed / std::numeric_limits<unsigned long>::max();
-    clicklp.clock(click * rand * .3f);
-    noise = clicklp.bp() * clickvol * .7f;
-    output += noise;
+  else if (vca_phase == VP_R && click > 0 && sustain == 0) {
+    float vca = vca_start;
+    const float dvca = (VCA - vca_start) / nframes;
+    for (i = 0; i < nframes; ++i) {
+      clicklp.clock(click * random() * .3f);
+      out[i] += wave() * vca + clicklp.bp() * clickvol * .7f;
+      vca += dvca;
+    }
   }
-      
   
-  // generate percussion sound
-  if (perc_ok && perc_phase > 0) {
-    
-    s0 = s0-a * s1;		// calculate sine wave
-    s1 = s1+a * s0;		//
-    output += perc * s0 * perc_vca * perc_vca;
+  // the normal case, just the wavetable with a VCA ramp
+  else {
+    float vca = vca_start;
+    const float dvca = (VCA - vca_start) / nframes;
+    for (i = 0; i < nframes; ++i) {
+      out[i] += wave() * vca;
+      vca += dvca;
+    }
+  }
   
-    // update percussion envelope every 5 samples
-    samplecount2++;
-    if (samplecount2 > 5) {
-      samplecount2 = 0;
-      
-      // percussion attack
-      if (perc_phase == 1) {
-	perc_vca += adsr_attack;
-	if (perc_vca >= 1)
-	  perc_phase = 2;	// switch to percussion decay
-      }
-      
-      // percussion decay 
-      else if (perc_phase == 2) {
-	perc_vca -= perc_decay;
-	if (perc_vca <= 0) {
-	  perc_vca = 0;
-	  perc_phase = 0;	// percussion finished
-	}
-      }
+  // the note that is measured is audible when the envelope of this block
+  // is above 0 and no other note is fading out first
+  if (onset >= 0 && !onset_done) {
+    if (vca_phase != VP_FR && VCA > 0)
+      onset_done = true;
+    else
+      onset += nframes;
+  }
+  
+  if (!done)
+    return;
+  
+  // the release is finished, go to idle state
+  if (vca_phase == VP_R) {
+    actual_note = -1;
+    phase = 0;
+    vca_phase = VP_IDLE;
+    status = VS_IDLE;
+  }
+  
+  // the fast release is finished, start the next note if there is one
+  else {
+    actual_note = -1;
+    if (next_note >= 0) {
+      actual_note = next_note;
+      next_note = -1;
+      vca_phase = VP_A;
+      phase = 0;
+      this->voicecalc();
       
-      // percussion fast release
-      else if (perc_phase == 3)	{
-	perc_vca -= adsr_fast_release;
-	if (perc_vca <= 0) {
-	  perc_vca = 0;
-	  perc_phase = 0;	// percussion finished
-	}
-      }
+      // retrigger percussion
+      perc_trigger();
     }
+    else
+      status = VS_IDLE;
   }
-
-  output = DENORMALIZE(output);
-  return output;
 }
 
 
@@ -363,25 +632,26 @@ bool voice::get_active() {
 void voice::note_on(long note, long velocity, volatile float *table, int size, 
 		    float pitch, bool percenable, float sclick, float sust) {
   
-  my_table = table;
-  my_size = size;
+  my_chain = table;
+  my_chain_size = size;
+  fade = 0;
   click = sclick;
   perc_ok = percenable;
   sustain = sust;
 
   if (note >= 0 && note < 128) {
     if (click > 0) {
-      float clickfreq = (freqtab[note] + 70) * 16;
+      float clickfreq = (tables->freq[note] + 70) * 16;
       if (clickfreq > 5000)
 	clickfreq = 5000;
       //clicklp.setparam(3000+clickfreq * .3f,.1f,samplerate);
-      clicklp.setparam(clickfreq, .1f, samplerate);
+      clicklp.setparam(clickfreq, .1f, tables->samplerate);
       clickvol = note * note * .0008f;
     }
     if (actual_note >= 0) {	// fast retrigger
       next_note = note;
       vca_phase = VP_FR;
-      perc_phase = 3;
+      pbank->release(pindex);
     }
     else {				// normal note on
       VCA = 0;
@@ -390,9 +660,8 @@ void voice::note_on(long note, long velocity, volatile float *table, int size,
       vca_phase = VP_A;
 
       actual_note = note & 0x7f;
-      perc_phase = 0;
       this->voicecalc();
-      perc_phase = 1;
+      perc_trigger();
     }
 
     status = VS_PLAYING;
@@ -402,6 +671,22 @@ void voice::note_on(long note, long velocity, volatile float *table, int size,
 }
 
 
+void voice::measure_onset(long delay) {
+  onset = delay;
+  onset_done = false;
+}
+
+
+bool voice::get_onset(long& frames) {
+  if (!onset_done)
+    return false;
+  frames = onset;
+  onset = -1;
+  onset_done = false;
+  return true;
+}
+
+
 void voice::note_off(long note) {
   if (note == actual_note && next_note >= 0) {
     vca_phase = VP_FR;
@@ -437,8 +722,10 @@ void voice::set_percussion(float percussion, float perc_multiplier,
 			   float percfade) {
   if (percussion >= 0)
     perc = percussion * 2;
-  if (perc_multiplier >= 0)
+  if (perc_multiplier >= 0) {
     percmultiplier = perc_multiplier;
+    percindex = voicetables::perc_index(perc_multiplier);
+  }
   if (percfade >= 0)
     perc_fade = 1-percfade+.5f;
 }
@@ -450,10 +737,34 @@ void voice::set_pitch(float pitch) {
 }
 
 
+void voice::switch_tables(ptrdiff_t offset) {
+  if (!my_chain)
+    return;
+  my_chain += offset;
+  my_table += offset;
+}
+
+
+void voice::set_fade(ptrdiff_t offset, float weight, float step) {
+  if (!my_chain)
+    return;
+  fade_offset = offset;
+  fade = (actual_note >= 0 ? weight : 0);
+  fade_step = step;
+}
+
+
+void voice::end_fade() {
+  fade = 0;
+}
+
+
 notemaster::notemaster(int number) {
   my_samplerate = 44100;
+  my_seed = 22222;
   pitch = next_pitch = 1;
   my_percussion = -1;
+  numonsets = 0;
   if (number < 1)
     number = 1;
   if (number>MAXVOICES)
@@ -469,6 +780,8 @@ notemaster::notemaster(int number) {
       chan[x] = 15;
       voices[x]->reset();
       voices[x]->set_samplerate(my_samplerate);
+      voices[x]->set_seed(my_seed + x * 0x9E3779B9);
+      voices[x]->set_percbank(&percs, x);
       volume[x] = 1;
     }
   }
@@ -497,6 +810,7 @@ void notemaster::set_numofvoices(int number) {
     voices[x] = NULL;
     age[x] = 0;
   }
+  percs.reset();
   for (x = 0; x <= number;x++) {
     voices[x] = new voice();
     if (voices[x] != NULL) {
@@ -505,6 +819,8 @@ void notemaster::set_numofvoices(int number) {
       voices[x]->reset();
       voices[x]->set_samplerate(my_samplerate);
       voices[x]->set_percussion(my_percussion,my_perc_multiplier,my_percfade);
+      voices[x]->set_seed(my_seed + x * 0x9E3779B9);
+      voices[x]->set_percbank(&percs, x);
       volume[x] = 1;
     }
   }
@@ -514,7 +830,7 @@ void notemaster::set_numofvoices(int number) {
 
 void notemaster::note_on(long note, long velocity, volatile float *table, 
 			 int size1, int channel, bool percenable, 
-			 float click, float sustain) {
+			 float click, float sustain, long delay) {
   /*
     The most interesting part here is the note priority and "stealing"
     algorithm. We do it this way:
@@ -577,12 +893,14 @@ void notemaster::note_on(long note, long velocity, volatile float *table,
   }
 
   // let the voice play the note. Fast retrigger is handled by the voice.
-  voices[newpos]->note_on(note,velocity,table,size1,pitch,percenable,click,sustain);
   age[newpos] = 0;
   if (channel>0 && channel < 3)
     chan[newpos] = (unsigned char)channel;
   else
     chan[newpos] = 0;
+  percs.set_channel(newpos, chan[newpos]);
+  voices[newpos]->note_on(note,velocity,table,size1,pitch,percenable,click,sustain);
+  voices[newpos]->measure_onset(delay);
 }
 
 
@@ -607,15 +925,21 @@ void notemaster::note_off(long note, int channel) {
 }
 
 
-float *notemaster::clock() {
-  output[0] = output[1] = output[2] = 0;
+void notemaster::render(float out[][ENVBLOCKSIZE], int nframes) {
+  int	c, i;
+  for (c = 0; c < 3; c++)
+    memset(out[c], 0, nframes * sizeof(float));
+  numonsets = 0;
   for (x = 0; x <= numofvoices;x++)
-    if (chan[x] < 3)
-      output[chan[x]] += volume[chan[x]] * voices[x]->clock();
-  //	output[0]=DENORMALIZE(output[0]);
-  //	output[1]=DENORMALIZE(output[1]);
-
-  return(output);
+    if (chan[x] < 3) {
+      voices[x]->render(out[chan[x]], nframes);
+      if (voices[x]->get_onset(onsets[numonsets]))
+	++numonsets;
+    }
+  percs.render(out, nframes);
+  for (c = 0; c < 3; c++)
+    for (i = 0; i < nframes; i++)
+      out[c][i] *= volume[c];
 }
 
 
@@ -673,15 +997,44 @@ void notemaster::set_volume(float vol, int channel) {
 }
 
 
+void notemaster::set_seed(uint32_t seed) {
+  my_seed = seed;
+  for (x = 0; x <= numofvoices;x++)
+    voices[x]->set_seed(my_seed + x * 0x9E3779B9);
+}
+
+
+void notemaster::switch_tables(ptrdiff_t offset, int fadeframes) {
+  for (x = 0; x <= numofvoices;x++) {
+    voices[x]->switch_tables(offset);
+    voices[x]->set_fade(offset, 1, 1.0f / fadeframes);
+  }
+}
+
+
+void notemaster::set_fade(ptrdiff_t offset, float weight, float step) {
+  for (x = 0; x <= numofvoices;x++)
+    voices[x]->set_fade(offset, weight, step);
+}
+
+
+void notemaster::end_fade() {
+  for (x = 0; x <= numofvoices;x++)
+    voices[x]->end_fade();
+}
+
+
 void notemaster::reset() {
   for (x = 0; x <= numofvoices;x++)
     voices[x]->reset();
+  percs.reset();
 }
 
 
 void notemaster::suspend() {
   for (x = 0; x <= numofvoices;x++)
     voices[x]->suspend();
+  percs.reset();
 }
 
 
@@ -25,11 +25,19 @@
 #ifndef __Voice_Classes_h__
 #define __Voice_Classes_h__
 
+#include <stddef.h>
+#include <stdint.h>
+
 #include "fx.hpp"
 #include "filters.hpp"
+#include "globals.hpp"
 
 #define MAXVOICES	32
 
+// the largest number of samples that the voices render with one envelope
+// update, see voice::render()
+#define ENVBLOCKSIZE	16
+
 // voice stati	(status)
 
 #define	VS_IDLE		0
@@ -51,16 +59,97 @@
 char*	note2str(long note);
 
 
+// the possible percussion octave multipliers, see AZR3::process()
+#define	NUMOFPERCMULTS	10
+
+
+/** Samplerate dependent constants for the voices. One of these is computed
+    for every samplerate that is used in the process and then shared by all
+    voices in all engines, so a note on only needs to do table lookups. A
+    voicetables object is never changed or freed once it has been created. */
+class voicetables {
+ public:
+  /** Return the tables for the given samplerate, creating them if needed.
+      This may allocate memory, so don't call it from the audio thread. */
+  static const voicetables* get(float samplerate);
+  /** Return the index of a percussion multiplier in perc_coeff. */
+  static int perc_index(float perc_multiplier);
+  
+  float	samplerate;
+  float	freq[128];			// MIDI note -> frequency
+  float	cycles[128];		// MIDI note -> waveform periods per sample
+  float	perc_coeff[NUMOFPERCMULTS][128];	// percussion sine coefficients
+  float	click_attack;
+  float	attack;
+  float	fast_release;
+  float	release;			// release factor when sustain is off
+  float	release_scale;		// release step scaler when sustain is on
+  float	perc_decay;			// percussion decay, multiply with perc_fade
+  float	release_pow[ENVBLOCKSIZE+1];	// release factor for n samples
+	
+ private:
+  voicetables(float samplerate);
+  
+  static const float perc_multipliers[NUMOFPERCMULTS];
+  const voicetables* next;
+};
+
+
+/** The percussion generators for all voices in a notemaster. The state is
+    kept as a structure of arrays where only the sounding generators are
+    packed at the front, so render() only pays for percussion that is
+    actually active and the inner loop runs over contiguous arrays. */
+class percbank {
+ public:
+  percbank();
+  void	reset();
+  /** Set the output channel for the percussion of voice @c v. */
+  void	set_channel(int v, int channel);
+  /** Start the percussion for voice @c v. */
+  void	trigger(int v, float a, float volume, float attack, float decay,
+		float fast_release);
+  /** Fade out the percussion for voice @c v quickly. */
+  void	release(int v);
+  /** Add nframes (at most ENVBLOCKSIZE) samples to the channel buffers. */
+  void	render(float out[][ENVBLOCKSIZE], int nframes);
+	
+ private:
+  void	remove(int k);
+  
+  int		numactive;
+  int		slot[MAXVOICES+1];		// voice -> index, -1 if not active
+  int		owner[MAXVOICES+1];		// index -> voice
+  int		vchan[MAXVOICES+1];		// voice -> channel
+  int		chan[MAXVOICES+1];
+  int		phase[MAXVOICES+1];		// 1: attack, 2: decay, 3: fast release
+  float	a[MAXVOICES+1];			// sine coefficients
+  float	s0[MAXVOICES+1];
+  float	s1[MAXVOICES+1];
+  float	vca[MAXVOICES+1];
+  float	vol[MAXVOICES+1];
+  float	attack[MAXVOICES+1];
+  float	decay[MAXVOICES+1];
+  float	fast_release[MAXVOICES+1];
+};
+
+
 /** This is a single organ voice. */
 class voice {
  public:
   voice();
   ~voice() {}
-  float	clock();
+  void	render(float* out, int nframes);
   void	reset();
   void	suspend();
   void	resume();
   void	note_on(long note, long velocity, volatile float *table, int size, float pitch, bool percenable, float sclick, float sust);
+  /** Count the frames until the note that was just started gets a
+      non-zero envelope, starting at @c delay. */
+  void	measure_onset(long delay);
+  /** Returns true once when the measured note has become audible, with
+      the frames from its note on to the envelope block where that
+      happened in @c frames. */
+  bool	get_onset(long& frames);
   void	note_off(long note);
   void	force_off();
   long	get_note();
@@ -73,46 +162,68 @@ class voice {
   void	set_pedal(bool pedal);
   void	set_percussion(float percussion,float perc_multiplier,float percfade);
   void	set_pitch(float pitch);
+  void	set_seed(uint32_t seed);
+  void	set_percbank(percbank* bank, int index);
   void	voicecalc();
+  /** Move the wavetable pointers @c offset floats ahead, into another set
+      of tables with the same layout. */
+  void	switch_tables(ptrdiff_t offset);
+  /** Mix in the tables at @c offset floats before the current ones, with
+      a weight that starts at @c weight and goes down by @c step every
+      sample. The old tables must stay valid until it reaches 0 or
+      end_fade() is called. */
+  void	set_fade(ptrdiff_t offset, float weight, float step);
+  /** Stop reading from the old tables right away. */
+  void	end_fade();
 	
  private:
-  unsigned char	samplecount1,samplecount2;
+  inline float	random();
+  inline float	wave();
+  void	perc_trigger();
+  
+  const voicetables*	tables;	// shared samplerate dependent constants
+  uint32_t	randseed;		// state of the click noise generator
   int		status;
-  int		iphase;
-  float	y0,y1,fract;
-  float	samplerate_scaler;	// Anpassung der Wavetable-Logik an Samplerate
+#if FIXEDPHASE
+  uint32_t	phase;			// Position in der Wavetable, 2^32 = eine Periode
+  uint32_t	phaseinc;		// increment for phase
+  int		phaseshift;			// phase >> phaseshift = Index im mip level
+  uint32_t	fractmask;		// phase & fractmask = Nachkommateil ...
+  float	fractscale;			// ... und fractscale skaliert ihn auf [0..1)
+#else
   float	phase;				// Position in der Wavetable
   float	phaseinc;			// increment for phase
-  float	output;				// Ausgang
+#endif
   float	click;				// click strength
-  float	hertz,a,s0,s1;		// percussion sine values
+  percbank*	pbank;			// the percussion generators ...
+  int		pindex;				// ... and our index there
+  float	perc_a;				// percussion sine coefficient
   float	percmultiplier;		// percussion octave multiplier
+  int		percindex;			// index of percmultiplier in the tables
   float	perc;				// percussion volume
   bool	perc_ok;
   float	perc_decay;
-  float	perc_vca;
-  int		perc_phase;
-  float	perc_attack;
   float	perc_fade;
   long	actual_note;	// Note-Daten
   long	next_note;			// Vorbesetzung von actual_note.
   long	perc_next_note;
-  volatile float	*my_table;			// die Wavetable
-  long	mask,my_size;		// Maske und Gre der Wavetable
-  float	samplerate;
-  double	midi_scaler;		// Umrechung Midi->float-Faktor [0..1]
-  float	freqtab[128];		// Umrechnung Midi->Frequenz
-  float	noise;
+  volatile float	*my_chain;			// die Wavetable, mit allen mip levels
+  long	my_chain_size;		// Gre des grten mip levels
+  volatile float	*my_table;			// der aktuelle mip level
+  long	my_size;			// Gre des aktuellen mip levels
+  ptrdiff_t	fade_offset;		// the old tables are at my_table - fade_offset
+  float	fade;				// weight of the old tables, 0 when not fading
+  float	fade_step;
   float	clickattack;
   float	clickvol;
   float	adsr_attack;
-  float	adsr_decay;
-  float	adsr_sustain;
   float	adsr_release;
   float	adsr_fast_release;
   float	sustain;
   float	VCA;				// VCA-Faktor. Wird durch attack und release beeinflut
   int		vca_phase;			// 1:Attack 2:Release
+  long	onset;				// frames since the note on, -1 if not measuring
+  bool	onset_done;			// the measured note is audible
   bool	pedal;				// Pedalzustand
   float	pitch;
   filt1	clicklp;
@@ -125,29 +236,48 @@ class notemaster {
   notemaster(int number);		// Anzahl der Stimmen
   ~notemaster();
   void	set_numofvoices(int number);
-  void	note_on(long note, long velocity, volatile float *table, int size1, int channel, bool percenable, float click, float sustain);
+  /** Play a note. @c delay is the number of frames that the note on is
+      late already, it is added to the onset the voice measures. */
+  void	note_on(long note, long velocity, volatile float *table, int size1, int channel, bool percenable, float click, float sustain, long delay);
   void	all_notes_off();
-  float	*clock();
+  /** Render nframes (at most ENVBLOCKSIZE) samples for each channel. */
+  void	render(float out[][ENVBLOCKSIZE], int nframes);
+  /** The number of notes that have become audible in the last render(). */
+  int	get_num_onsets() { return numonsets; }
+  /** The frames from the note on to the first audible envelope block of
+      one of these notes, see voice::get_onset(). */
+  long	get_onset(int i) { return onsets[i]; }
   void	note_off(long note, int channel);
   void	set_pedal(int pedal, int channel);
   void	set_percussion(float percussion,float perc_multiplier,float percfade);
   void	set_samplerate(float samplerate);
   void	set_pitch(float pitch, int channel);
   void	set_volume(float vol, int channel);
+  void	set_seed(uint32_t seed);
+  /** Rebase all voices on a new set of wavetables and fade out the old
+      ones over @c fadeframes samples, see voice::switch_tables(). */
+  void	switch_tables(ptrdiff_t offset, int fadeframes);
+  /** Set the weight of the old tables for all voices, see
+      voice::set_fade(). */
+  void	set_fade(ptrdiff_t offset, float weight, float step);
+  void	end_fade();
   void	reset();
   void	suspend();
   void	resume();
  private:
   voice	*voices[MAXVOICES+1];
+  percbank	percs;
   int		numofvoices;
   unsigned long	age[MAXVOICES];
   unsigned char	chan[MAXVOICES];
   float	volume[MAXVOICES];
-  float	output[16];
   int		x;
   float	pitch,next_pitch;
+  long	onsets[MAXVOICES+1];
+  int		numonsets;
 
   float	my_click,my_percussion,my_perc_multiplier,my_percfade,my_samplerate;
+  uint32_t	my_seed;
 };
 
 #endif